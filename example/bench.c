@@ -0,0 +1,911 @@
+// SPDX-License-Identifier: BSL-1.0
+
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+// Measures the hot paths of the shell against the code they replaced.
+// The numbers of a run are kept in bench.txt.
+
+#include "emsh.h"
+#define LIST_DEBUG 0 // the list walk without its sanity checks
+#include "list.h"
+#include "numcast10.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if !EMSH_ENABLE_RUNTIME_SIZE
+#error "the benchmark sizes the shell at run time (EMSH_ENABLE_RUNTIME_SIZE)"
+#endif
+
+#define BENCH_MAX_LINE_SIZE 4096
+#define BENCH_MAX_HIST_SIZE 50000
+#define BENCH_HIST_MEM_SIZE (4 * 1024 * 1024)
+#define BENCH_MAX_N_ARGS 32
+#define BENCH_MIN_TIME 0.2 ///< seconds a measurement runs at least
+
+/*
+ * shell under measurement
+ */
+
+typedef struct bench
+{
+	emsh_t emsh;
+	size_t n_out; ///< bytes written by the shell
+	size_t n_exec;
+} bench_t;
+
+static char bench_hist_mem[BENCH_HIST_MEM_SIZE];
+static char bench_line_mem[EMSH_LINE_MEM_SIZE(BENCH_MAX_LINE_SIZE)];
+static emsh_hist_slot_t bench_hist_ring[BENCH_MAX_HIST_SIZE];
+#if EMSH_ENABLE_PREFIX_SEARCH
+static size_t bench_hist_sorted[BENCH_MAX_HIST_SIZE];
+#endif
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+static size_t bench_hist_hash[EMSH_HIST_HASH_SIZE(BENCH_MAX_HIST_SIZE)];
+#endif
+#if EMSH_ENABLE_SEARCH_INDEX
+static emsh_hist_trigram_t bench_hist_trigrams[EMSH_SEARCH_INDEX_SIZE];
+static size_t bench_hist_chain[BENCH_HIST_MEM_SIZE];
+#endif
+static emsh_iov_t bench_args[BENCH_MAX_N_ARGS];
+static const char *bench_argv[BENCH_MAX_N_ARGS];
+#if EMSH_ENABLE_OUTPUT_BUFFER
+static char bench_out_buf[256];
+#endif
+static bench_t g_bench;
+
+static void _bench_write_strn(uintptr_t cookie, const char *str, size_t len)
+{
+	(void)str;
+	((bench_t *)cookie)->n_out += len;
+}
+
+static void _bench_exec(uintptr_t cookie, int argc, const emsh_iov_t *args)
+{
+	(void)argc;
+	(void)args;
+	++((bench_t *)cookie)->n_exec;
+}
+
+/// starts a fresh shell with room for max_line_size characters and max_hist_size entries
+static emsh_t *bench_shell(size_t max_line_size, size_t max_hist_size)
+{
+	emsh_conf_t conf = {
+		.cookie = (uintptr_t)&g_bench,
+		.ops = {
+			.write_strn = &_bench_write_strn,
+			.exec_spans = &_bench_exec,
+		},
+		.hist_mem = bench_hist_mem,
+		.hist_mem_size = max_hist_size * EMSH_HIST_ENTRY_SIZE(max_line_size),
+		.hist_ring = bench_hist_ring,
+#if EMSH_ENABLE_PREFIX_SEARCH
+		.hist_sorted = bench_hist_sorted,
+#endif
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+		.hist_hash = bench_hist_hash,
+#endif
+#if EMSH_ENABLE_SEARCH_INDEX
+		.hist_trigrams = bench_hist_trigrams,
+		.hist_chain = bench_hist_chain,
+#endif
+		.max_hist_size = max_hist_size,
+		.line_mem = bench_line_mem,
+		.max_line_size = max_line_size,
+		.args = bench_args,
+		.argv = bench_argv,
+		.max_n_args = BENCH_MAX_N_ARGS,
+#if EMSH_ENABLE_OUTPUT_BUFFER
+		.out_buf = bench_out_buf,
+		.out_buf_size = sizeof(bench_out_buf),
+#endif
+	};
+
+	assert(max_line_size <= BENCH_MAX_LINE_SIZE);
+	assert(max_hist_size <= BENCH_MAX_HIST_SIZE);
+	assert(conf.hist_mem_size <= BENCH_HIST_MEM_SIZE);
+	emsh_init(&g_bench.emsh, &conf);
+	emsh_start(&g_bench.emsh);
+	g_bench.n_out = 0;
+	g_bench.n_exec = 0;
+	return &g_bench.emsh;
+}
+
+/*
+ * timing
+ */
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/// the byte stream of the console automation: commands with a few arguments
+static size_t bench_script(char *buf, size_t size)
+{
+	static const char *const lines[] = {
+		"status\n",
+		"config set uart0.baudrate 115200\n",
+		"led 3 on brightness 128 duration 250\n",
+		"log grep 'link down' --since 10m --max 50\n",
+		"stats\n",
+	};
+	size_t len = 0;
+
+	for (size_t i = 0; ; ++i)
+	{
+		const char *line = lines[i % (sizeof(lines)/sizeof(*lines))];
+		size_t n = strlen(line);
+		if (len + n > size)
+		{
+			return len;
+		}
+		memcpy(&buf[len], line, n);
+		len += n;
+	}
+}
+
+/*
+ * emsh_task() vs emsh_task_n()
+ */
+
+static char bench_input[256 * 1024];
+
+static void bench_task(void)
+{
+	static const char *const names[] = {"emsh_task", "emsh_task_n"};
+	size_t len = bench_script(bench_input, sizeof(bench_input));
+
+	for (int k = 0; k < 2; ++k)
+	{
+		emsh_t *sh = bench_shell(256, 64);
+		size_t n = 0;
+		double t;
+		double begin = bench_now();
+		do
+		{
+			if (k == 0)
+			{
+				for (size_t i = 0; i < len; ++i)
+				{
+					emsh_task(sh, (unsigned char)bench_input[i]);
+				}
+			}
+			else
+			{
+				// in chunks as read() returns them from a pipe
+				for (size_t i = 0; i < len; i += 4096)
+				{
+					emsh_task_n(sh, &bench_input[i], (len - i < 4096) ? len - i : 4096);
+				}
+			}
+			n += len;
+			t = bench_now() - begin;
+		}
+		while (t < BENCH_MIN_TIME);
+
+		fprintf(stdout, "task: %-11s %8.1f MB/s, %.2f bytes out per byte in\n",
+		        names[k], (double)n / t * 1e-6, (double)g_bench.n_out / (double)n);
+	}
+}
+
+/*
+ * bytes sent per mid-line edit, in the mode built (CFLAGS=-DEMSH_ENABLE_ICH_DCH=1 for ICH/DCH)
+ */
+
+static void bench_redraw(void)
+{
+	static const size_t lens[] = {20, 80, 200};
+
+	for (size_t k = 0; k < sizeof(lens)/sizeof(*lens); ++k)
+	{
+		emsh_t *sh = bench_shell(256, 64);
+		size_t n_edits = 1000;
+		size_t n_insert = 0;
+		size_t n_erase = 0;
+
+		for (size_t i = 0; i < lens[k]; ++i)
+		{
+			emsh_task(sh, 'a' + (int)(i % 26));
+		}
+		for (size_t i = 0; i < lens[k] / 2; ++i)
+		{
+			emsh_task(sh, ASCII_CNTRL('B'));
+		}
+
+		for (size_t i = 0; i < n_edits; ++i)
+		{
+			size_t n_out = g_bench.n_out;
+			emsh_task(sh, 'x');
+			n_insert += g_bench.n_out - n_out;
+
+			n_out = g_bench.n_out;
+			emsh_task(sh, ASCII_C_DEL);
+			n_erase += g_bench.n_out - n_out;
+		}
+
+		fprintf(stdout, "redraw: EMSH_ENABLE_ICH_DCH=%d, %3zu-char line, cursor in the middle: %5.1f bytes per insert, %5.1f per erase\n",
+		        EMSH_ENABLE_ICH_DCH, lens[k], (double)n_insert / (double)n_edits, (double)n_erase / (double)n_edits);
+	}
+}
+
+/*
+ * line storage: memmove per keystroke (bytearray_t) vs gap buffer (gapbuf_t)
+ */
+
+static unsigned char bench_line[BENCH_MAX_LINE_SIZE];
+
+static void bench_buf(void)
+{
+	static const size_t sizes[] = {80, 1024, 4096};
+	static const char word[] = "brightness";
+	const size_t pos = 8; // editing near the front of the line
+	const size_t n = sizeof(word) - 1;
+
+	for (size_t k = 0; k < sizeof(sizes)/sizeof(*sizes); ++k)
+	{
+		size_t len = sizes[k] - n; // full once the word is typed
+		double ns[2];
+		unsigned sum = 0;
+
+		for (int impl = 0; impl < 2; ++impl)
+		{
+			bytearray_t ba;
+			gapbuf_t gb;
+			size_t n_keys = 0;
+			double t;
+			double begin = bench_now();
+
+			bytearray_init(&ba, sizes[k], bench_line);
+			gapbuf_init(&gb, sizes[k], bench_line);
+			for (size_t i = 0; i < len; ++i)
+			{
+				if (impl == 0)
+				{
+					bytearray_push_back(&ba, (unsigned char)('a' + i % 26));
+				}
+				else
+				{
+					gapbuf_insert(&gb, i, (unsigned char)('a' + i % 26));
+				}
+			}
+
+			// types the word and erases it with BS
+			do
+			{
+				for (int r = 0; r < 1000; ++r)
+				{
+					for (size_t i = 0; i < n; ++i)
+					{
+						if (impl == 0)
+						{
+							bytearray_insert(&ba, pos + i, (unsigned char)word[i]);
+						}
+						else
+						{
+							gapbuf_insert(&gb, pos + i, (unsigned char)word[i]);
+						}
+					}
+					for (size_t i = n; i > 0; --i)
+					{
+						if (impl == 0)
+						{
+							bytearray_erase(&ba, pos + i - 1);
+						}
+						else
+						{
+							gapbuf_erase(&gb, pos + i - 1);
+						}
+					}
+				}
+				n_keys += 1000 * 2 * n;
+				t = bench_now() - begin;
+			}
+			while (t < BENCH_MIN_TIME);
+
+			sum += (impl == 0) ? bytearray_data(&ba)[pos] : gapbuf_at(&gb, pos);
+			ns[impl] = t / (double)n_keys * 1e9;
+		}
+
+		fprintf(stdout, "buf: %4zu-byte line, editing at %zu: bytearray %6.1f ns per key, gapbuf %4.1f ns per key%s\n",
+		        sizes[k], pos, ns[0], ns[1], (sum == 2u * 'i') ? "" : " (mismatch)");
+	}
+}
+
+/*
+ * recalling a deep history entry: !-N on the ring vs walking the list of the former history
+ */
+
+/// a history block as the list kept them, for lines of the default size
+typedef struct bench_block
+{
+	list_node_t node;
+	size_t len;
+	char mem[EMSH_MAX_LINE_SIZE+1];
+} bench_block_t;
+
+static bench_block_t bench_blocks[BENCH_MAX_HIST_SIZE];
+
+static void bench_hist(void)
+{
+	static const size_t sizes[] = {1000, 10000};
+
+	for (size_t k = 0; k < sizeof(sizes)/sizeof(*sizes); ++k)
+	{
+		size_t n_hist = sizes[k];
+		emsh_t *sh = bench_shell(EMSH_MAX_LINE_SIZE, n_hist);
+		list_t list;
+		char line[32];
+
+		list_init(&list);
+		for (size_t i = 0; i < n_hist; ++i)
+		{
+			int len = snprintf(line, sizeof(line), "cmd %05zu", i);
+			emsh_hist_push(sh, line, (size_t)len);
+
+			list_node_init(&bench_blocks[i].node);
+			memcpy(bench_blocks[i].mem, line, (size_t)len + 1);
+			bench_blocks[i].len = (size_t)len;
+			list_push_back(&list, &bench_blocks[i].node);
+		}
+
+		size_t depths[] = {1, n_hist / 2, n_hist - 1};
+		for (size_t d = 0; d < sizeof(depths)/sizeof(*depths); ++d)
+		{
+			size_t depth = depths[d];
+			double ns[2];
+
+			// the list: from the newest entry, one node per step
+			size_t n = 0;
+			size_t sum = 0;
+			double t;
+			double begin = bench_now();
+			do
+			{
+				for (int r = 0; r < 100; ++r)
+				{
+					list_node_t *node = list_back(&list);
+					for (size_t i = 1; i < depth; ++i)
+					{
+						node = list_node_prev(node);
+					}
+					sum += list_entry_of(node, bench_block_t, node)->len;
+				}
+				n += 100;
+				t = bench_now() - begin;
+			}
+			while (t < BENCH_MIN_TIME);
+			ns[0] = t / (double)n * 1e9;
+
+			// the ring: a whole "!-N" command, expanded, run and added to the history
+			int len = snprintf(line, sizeof(line), "!-%zu\n", depth);
+			n = 0;
+			begin = bench_now();
+			do
+			{
+				for (int r = 0; r < 100; ++r)
+				{
+					emsh_task_n(sh, line, (size_t)len);
+				}
+				n += 100;
+				t = bench_now() - begin;
+			}
+			while (t < BENCH_MIN_TIME);
+			ns[1] = t / (double)n * 1e9;
+
+			fprintf(stdout, "hist: %5zu entries, depth %4zu: list walk %8.1f ns, !-N command %6.1f ns%s\n",
+			        n_hist, depth, ns[0], ns[1], (sum != 0 && g_bench.n_exec == n) ? "" : " (mismatch)");
+			g_bench.n_exec = 0;
+		}
+	}
+}
+
+/*
+ * Ctrl-R latency per query keystroke over a full history vs a plain substring scan
+ */
+
+static char bench_entries[BENCH_MAX_HIST_SIZE][32];
+
+/// the age of the newest of n entries containing query, 0 for none, as a scan without an index finds it
+static size_t bench_scan(size_t n, const char *query, size_t query_len)
+{
+	for (size_t age = 1; age <= n; ++age)
+	{
+		const char *str = bench_entries[n - age];
+		size_t len = strlen(str);
+		for (size_t i = 0; i + query_len <= len; ++i)
+		{
+			if (memcmp(&str[i], query, query_len) == 0)
+			{
+				return age;
+			}
+		}
+	}
+	return 0;
+}
+
+static void bench_search(void)
+{
+	static const size_t sizes[] = {1000, 10000, 50000};
+	static const char *const queries[] = {"port00000", "portx"}; // the oldest entry, none
+
+	for (size_t k = 0; k < sizeof(sizes)/sizeof(*sizes); ++k)
+	{
+		size_t n_hist = sizes[k];
+		emsh_t *sh = bench_shell(EMSH_MAX_LINE_SIZE, n_hist);
+
+		for (size_t i = 0; i < n_hist; ++i)
+		{
+			int len = snprintf(bench_entries[i], sizeof(bench_entries[i]), "set port%05zu speed %zu", i, 10 + i % 1000);
+			emsh_hist_push(sh, bench_entries[i], (size_t)len);
+		}
+
+		for (size_t q = 0; q < sizeof(queries)/sizeof(*queries); ++q)
+		{
+			const char *query = queries[q];
+			size_t query_len = strlen(query);
+			double ns[2];
+			size_t n = 0;
+			size_t sum = 0;
+			double t;
+			double begin = bench_now();
+
+			// the scan, once per prefix of the query as it's typed
+			do
+			{
+				for (size_t i = 1; i <= query_len; ++i)
+				{
+					sum += bench_scan(n_hist, query, i);
+				}
+				n += query_len;
+				t = bench_now() - begin;
+			}
+			while (t < BENCH_MIN_TIME);
+			ns[0] = t / (double)n * 1e9;
+
+			// the shell: Ctrl-R, the query, Ctrl-G
+			n = 0;
+			begin = bench_now();
+			do
+			{
+				emsh_task(sh, ASCII_CNTRL('R'));
+				for (size_t i = 0; i < query_len; ++i)
+				{
+					emsh_task(sh, query[i]);
+				}
+				emsh_task(sh, ASCII_CNTRL('G'));
+				n += query_len;
+				t = bench_now() - begin;
+			}
+			while (t < BENCH_MIN_TIME);
+			ns[1] = t / (double)n * 1e9;
+
+			fprintf(stdout, "search: %5zu entries, query %-9s: substring scan %8.1f ns per key, Ctrl-R %7.1f ns per key%s\n",
+			        n_hist, query, ns[0], ns[1], (sum != 0) ? "" : " (mismatch)");
+		}
+	}
+}
+
+/*
+ * Up with a typed prefix over a full history vs a scan from the newest entry
+ */
+
+static void bench_prefix(void)
+{
+	static const size_t sizes[] = {1000, 10000};
+	static const char *const prefixes[] = {"set port", "show"}; // every entry but the oldest few, only those
+
+	for (size_t k = 0; k < sizeof(sizes)/sizeof(*sizes); ++k)
+	{
+		size_t n_hist = sizes[k];
+		emsh_t *sh = bench_shell(EMSH_MAX_LINE_SIZE, n_hist);
+
+		for (size_t i = 0; i < n_hist; ++i)
+		{
+			int len = (i < 4) ? snprintf(bench_entries[i], sizeof(bench_entries[i]), "show version %zu", i)
+			                  : snprintf(bench_entries[i], sizeof(bench_entries[i]), "set port%05zu speed %zu", i, 10 + i % 1000);
+			emsh_hist_push(sh, bench_entries[i], (size_t)len);
+		}
+
+		for (size_t q = 0; q < sizeof(prefixes)/sizeof(*prefixes); ++q)
+		{
+			const char *prefix = prefixes[q];
+			size_t len = strlen(prefix);
+			double ns[2];
+			size_t n = 0;
+			size_t sum = 0;
+			double t;
+			double begin = bench_now();
+
+			// the scan, once per Up and once per Down
+			do
+			{
+				for (int r = 0; r < 2; ++r)
+				{
+					for (size_t age = 1; age <= n_hist; ++age)
+					{
+						if (strncmp(bench_entries[n_hist - age], prefix, len) == 0)
+						{
+							sum += age;
+							break;
+						}
+					}
+				}
+				n += 2;
+				t = bench_now() - begin;
+			}
+			while (t < BENCH_MIN_TIME);
+			ns[0] = t / (double)n * 1e9;
+
+			// the shell: Up to the newest match, Down back to the prefix
+			emsh_task_n(sh, prefix, len);
+			n = 0;
+			begin = bench_now();
+			do
+			{
+				emsh_task_n(sh, CTLSEQ_S_CSI "A" CTLSEQ_S_CSI "B", 6);
+				n += 2;
+				t = bench_now() - begin;
+			}
+			while (t < BENCH_MIN_TIME);
+			ns[1] = t / (double)n * 1e9;
+			emsh_task(sh, ASCII_CNTRL('A'));
+			for (size_t i = 0; i < len; ++i)
+			{
+				emsh_task(sh, ASCII_CNTRL('D'));
+			}
+
+			fprintf(stdout, "prefix: %5zu entries, prefix %-8s: scan %8.1f ns per key, Up/Down %6.1f ns per key%s\n",
+			        n_hist, prefix, ns[0], ns[1], (sum != 0) ? "" : " (mismatch)");
+		}
+	}
+}
+
+/*
+ * character class scanning: per-byte predicates vs the buffer functions of ascii.h
+ */
+
+typedef size_t bench_scan_fn_t(const char *buf, size_t n);
+
+static size_t bench_span_print_1(const char *buf, size_t n)
+{
+	size_t i = 0;
+	while (i < n && ascii_isprint((unsigned char)buf[i]))
+	{
+		++i;
+	}
+	return i;
+}
+
+static size_t bench_find_cntrl_1(const char *buf, size_t n)
+{
+	size_t i = 0;
+	while (i < n && !ascii_iscntrl((unsigned char)buf[i]))
+	{
+		++i;
+	}
+	return i;
+}
+
+static size_t bench_count_digit_1(const char *buf, size_t n)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		count += ascii_isdigit((unsigned char)buf[i]) != 0;
+	}
+	return count;
+}
+
+static size_t bench_count_digit(const char *buf, size_t n)
+{
+	return ascii_count_class(buf, n, ASCII_CLASS_DIGIT);
+}
+
+static volatile size_t bench_sink;
+
+/// GB/s of fn over the first len bytes of buf
+static double bench_rate(bench_scan_fn_t *fn, const char *buf, size_t len)
+{
+	volatile size_t n_bytes = len; // read anew by each call
+	size_t n = 0;
+	size_t sum = 0;
+	double t;
+	double begin = bench_now();
+
+	do
+	{
+		for (int r = 0; r < 1000; ++r)
+		{
+			sum += fn(buf, n_bytes);
+		}
+		n += 1000 * len;
+		t = bench_now() - begin;
+	}
+	while (t < BENCH_MIN_TIME);
+
+	bench_sink = sum;
+	return (double)n / t * 1e-9;
+}
+
+static void bench_ascii(void)
+{
+	static const size_t lens[] = {16, 256, 4096};
+	static const struct
+	{
+		const char *name;
+		bench_scan_fn_t *per_byte;
+		bench_scan_fn_t *buffer;
+	} fns[] = {
+		{"ascii_span_print", &bench_span_print_1, &ascii_span_print},
+		{"ascii_find_first_cntrl", &bench_find_cntrl_1, &ascii_find_first_cntrl},
+		{"ascii_count_class", &bench_count_digit_1, &bench_count_digit},
+	};
+	static char buf[4096];
+
+	// a printable line with digits, without control characters
+	for (size_t i = 0; i < sizeof(buf); ++i)
+	{
+		buf[i] = (char)(' ' + (i * 7) % 95);
+	}
+
+	for (size_t f = 0; f < sizeof(fns)/sizeof(*fns); ++f)
+	{
+		for (size_t k = 0; k < sizeof(lens)/sizeof(*lens); ++k)
+		{
+			fprintf(stdout, "ascii: %-22s %4zu bytes: per byte %5.2f GB/s, buffer %5.2f GB/s\n", fns[f].name, lens[k],
+			        bench_rate(fns[f].per_byte, buf, lens[k]), bench_rate(fns[f].buffer, buf, lens[k]));
+		}
+	}
+}
+
+/*
+ * control sequence parsing: the table state machine, by byte and by buffer, vs the switch it replaced
+ */
+
+typedef ctlseq_ev_t bench_sm_fn_t(ctlseq_st_t *p_st, int c, int *p_psep);
+
+/// folds the event of a control sequence byte into digest
+static size_t bench_digest_ev(size_t digest, size_t pos, ctlseq_ev_t ev, ctlseq_st_t st, int psep)
+{
+	return ((digest * 31 + pos) * 8 + (size_t)ev) * 16 + (size_t)st * 2 + (size_t)psep;
+}
+
+/// MB/s of fn over buf, with a digest of the bytes of control sequences
+static double bench_parse(bench_sm_fn_t *fn, const char *buf, size_t len, size_t *p_digest)
+{
+	size_t n = 0;
+	size_t digest = 0;
+	double t;
+	double begin = bench_now();
+
+	do
+	{
+		digest = 0;
+		ctlseq_st_t st = CTLSEQ_ST_INIT;
+		for (size_t i = 0; i < len; ++i)
+		{
+			int psep;
+			ctlseq_ev_t ev = fn(&st, (unsigned char)buf[i], &psep);
+			if (ev != CTLSEQ_EV_NONE || st != CTLSEQ_ST_INIT)
+			{
+				digest = bench_digest_ev(digest, i, ev, st, psep);
+			}
+		}
+		n += len;
+		t = bench_now() - begin;
+	}
+	while (t < BENCH_MIN_TIME);
+
+	*p_digest = digest;
+	return (double)n / t * 1e-6;
+}
+
+/// same as bench_parse() with ctlseq_sm_n()
+static double bench_parse_n(const char *buf, size_t len, size_t *p_digest)
+{
+	ctlseq_event_t events[64];
+	size_t n = 0;
+	size_t digest = 0;
+	double t;
+	double begin = bench_now();
+
+	do
+	{
+		digest = 0;
+		ctlseq_st_t st = CTLSEQ_ST_INIT;
+		size_t i = 0;
+		while (i < len)
+		{
+			size_t n_events = ctlseq_sm_n(&st, &buf[i], len - i, events, sizeof(events)/sizeof(*events));
+			for (size_t k = 0; k < n_events; ++k)
+			{
+				digest = bench_digest_ev(digest, i + events[k].pos, events[k].ev, events[k].st, events[k].psep);
+			}
+			i = n_events == sizeof(events)/sizeof(*events) ? i + events[n_events - 1].pos + 1 : len;
+		}
+		n += len;
+		t = bench_now() - begin;
+	}
+	while (t < BENCH_MIN_TIME);
+
+	*p_digest = digest;
+	return (double)n / t * 1e-6;
+}
+
+static void bench_ctlseq(void)
+{
+	static const char *const seqs[] = {
+		"\x1b[A", "\x1b[1;5C", "\x1b[38;5;208m", "\x1b[0m", "\x1b[201~", "\x1b[?2004h",
+	};
+	static const size_t runs[] = {0, 4, 80};
+	static char buf[64 * 1024];
+
+	for (size_t k = 0; k < sizeof(runs)/sizeof(*runs); ++k)
+	{
+		// text runs of up to runs[k] letters between control sequences
+		size_t len = 0;
+		unsigned seed = 1;
+		while (len < sizeof(buf) - 64)
+		{
+			seed = seed * 1103515245 + 12345;
+			const char *seq = seqs[(seed >> 16) % (sizeof(seqs)/sizeof(*seqs))];
+			size_t run = runs[k] == 0 ? 0 : (seed >> 8) % runs[k] + 1;
+			for (size_t i = 0; i < run; ++i)
+			{
+				buf[len++] = (char)('a' + (i * 7 + seed) % 26);
+			}
+			while (*seq)
+			{
+				buf[len++] = *seq++;
+			}
+		}
+
+		size_t digest_ref;
+		size_t digest;
+		size_t digest_n;
+		double ref = bench_parse(&ctlseq_sm_ref, buf, len, &digest_ref);
+		double sm = bench_parse(&ctlseq_sm, buf, len, &digest);
+		double sm_n = bench_parse_n(buf, len, &digest_n);
+		fprintf(stdout, "ctlseq: text runs up to %2zu bytes: ctlseq_sm_ref %6.1f MB/s, ctlseq_sm %6.1f MB/s, ctlseq_sm_n %6.1f MB/s%s\n",
+		        runs[k], ref, sm, sm_n, digest == digest_ref && digest_n == digest_ref ? "" : " (mismatch)");
+	}
+}
+
+/*
+ * decimal formatting: numcast10 vs the divide-per-digit-then-reverse loop it replaced and snprintf()
+ */
+
+static size_t bench_from_ullong_old(char *dst, unsigned long long src)
+{
+	size_t n = 0;
+
+	do
+	{
+		dst[n++] = (char)(src % 10 + '0');
+		src /= 10;
+	}
+	while (src != 0);
+
+	for (size_t i = 0; i < n / 2; ++i)
+	{
+		char ch = dst[i];
+		dst[i] = dst[n-i-1];
+		dst[n-i-1] = ch;
+	}
+	return n;
+}
+
+static size_t bench_from_ullong(char *dst, unsigned long long src)
+{
+	return numcast10_from_ullong(dst, src);
+}
+
+static size_t bench_from_ullong_snprintf(char *dst, unsigned long long src)
+{
+	return (size_t)snprintf(dst, NUMCAST10_SIZE_OF(unsigned long long) + 1, "%llu", src);
+}
+
+typedef size_t bench_from_fn_t(char *dst, unsigned long long src);
+
+/// ns per conversion of fn over values below max, with a digest of the digits
+static double bench_format(bench_from_fn_t *fn, unsigned long long max, size_t *p_digest)
+{
+	char dst[NUMCAST10_SIZE_OF(unsigned long long) + 1]; // with the terminator of snprintf()
+	size_t n = 0;
+	size_t digest = 0;
+	double t;
+	double begin = bench_now();
+
+	do
+	{
+		digest = 0;
+		unsigned long long val = 1;
+		for (int r = 0; r < 1000; ++r)
+		{
+			val = (val * 6364136223846793005ULL + 1442695040888963407ULL);
+			size_t len = fn(dst, max == 0 ? val : val % max);
+			for (size_t i = 0; i < len; ++i)
+			{
+				digest = digest * 31 + (unsigned char)dst[i];
+			}
+		}
+		n += 1000;
+		t = bench_now() - begin;
+	}
+	while (t < BENCH_MIN_TIME);
+
+	*p_digest = digest;
+	return t / (double)n * 1e9;
+}
+
+static void bench_numcast10(void)
+{
+	static const struct
+	{
+		const char *name;
+		unsigned long long max; ///< 0 for the full range
+	} ranges[] = {
+		{"below 100 (CSI params)", 100},
+		{"below 10^10", 10000000000ULL},
+		{"full unsigned long long", 0},
+	};
+
+	for (size_t k = 0; k < sizeof(ranges)/sizeof(*ranges); ++k)
+	{
+		size_t digest_old;
+		size_t digest_libc;
+		size_t digest;
+		double old = bench_format(&bench_from_ullong_old, ranges[k].max, &digest_old);
+		double libc = bench_format(&bench_from_ullong_snprintf, ranges[k].max, &digest_libc);
+		double now = bench_format(&bench_from_ullong, ranges[k].max, &digest);
+		fprintf(stdout, "numcast10: %-23s: old loop %5.1f ns, snprintf %5.1f ns, numcast10_from_ullong %5.1f ns per value%s\n",
+		        ranges[k].name, old, libc, now, digest == digest_old && digest_libc == digest_old ? "" : " (mismatch)");
+	}
+}
+
+/*
+ * driver
+ */
+
+typedef struct bench_section
+{
+	const char *name;
+	void (*run)(void);
+} bench_section_t;
+
+static const bench_section_t bench_sections[] = {
+	{"task", &bench_task},
+	{"redraw", &bench_redraw},
+	{"buf", &bench_buf},
+	{"hist", &bench_hist},
+	{"search", &bench_search},
+	{"prefix", &bench_prefix},
+	{"ascii", &bench_ascii},
+	{"ctlseq", &bench_ctlseq},
+	{"numcast10", &bench_numcast10},
+};
+
+/// runs the sections named on the command line, all of them by default
+int main(int argc, char **argv)
+{
+	for (size_t i = 0; i < sizeof(bench_sections)/sizeof(*bench_sections); ++i)
+	{
+		bool run = (argc < 2);
+		for (int k = 1; k < argc; ++k)
+		{
+			run = run || strcmp(argv[k], bench_sections[i].name) == 0;
+		}
+		if (run)
+		{
+			bench_sections[i].run();
+		}
+	}
+	return 0;
+}
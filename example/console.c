@@ -4,6 +4,7 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          https://www.boost.org/LICENSE_1_0.txt)
 
+#include "cmdtab.h"
 #include "emsh.h"
 #include "numcast10.h"
 #include <stdio.h>
@@ -11,33 +12,51 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 
 /*
  * basic io
  */
 
-static int _fgetc(FILE *fp)
+static struct termios console_old_opts;
+static int console_raw; ///< whether console_old_opts has to be restored
+
+/// puts the terminal in non-canonical mode without echo for the whole session
+static void console_set_raw(void)
 {
-#if 0
-	return fgetc(fp);
-#else
-	struct termios old_opts;
-	tcgetattr(fileno(fp), &old_opts);
+	if (tcgetattr(STDIN_FILENO, &console_old_opts) != 0)
+	{
+		return; // not a terminal
+	}
 
 	struct termios new_opts;
-	memcpy(&new_opts, &old_opts, sizeof(new_opts));
-	new_opts.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHOK | ECHONL | ECHOPRT | ECHOKE | ICRNL);
-	tcsetattr(fileno(fp), TCSANOW, &new_opts);
-	int c = fgetc(fp);
+	memcpy(&new_opts, &console_old_opts, sizeof(new_opts));
+	new_opts.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHOK | ECHONL | ECHOPRT | ECHOKE);
+	new_opts.c_iflag &= ~ICRNL;
+	new_opts.c_cc[VMIN] = 1;
+	new_opts.c_cc[VTIME] = 0;
+	console_raw = (tcsetattr(STDIN_FILENO, TCSANOW, &new_opts) == 0);
+}
 
-	tcsetattr(fileno(fp), TCSANOW, &old_opts);
-	return c;
-#endif
+static void console_restore_mode(void)
+{
+	if (console_raw)
+	{
+		tcsetattr(STDIN_FILENO, TCSANOW, &console_old_opts);
+		console_raw = 0;
+	}
 }
 
-static int console_read_char(void)
+/// reads whatever input is available, blocking until there is some; 0 at the end of the input
+static size_t console_read(char *buf, size_t size)
 {
-	return _fgetc(stdin);
+	ssize_t n = read(STDIN_FILENO, buf, size);
+	return (n > 0) ? (size_t)n : 0;
 }
 
 static void console_write_char(int ch)
@@ -47,10 +66,12 @@ static void console_write_char(int ch)
 
 static void console_write_strn(const char *str, size_t len)
 {
-	for (size_t i = 0; i < len; ++i)
-	{
-		console_write_char(str[i]);
-	}
+	fwrite(str, 1, len, stdout);
+}
+
+static void console_flush(void)
+{
+	fflush(stdout);
 }
 
 static void console_write_str(const char *str)
@@ -81,7 +102,7 @@ typedef struct console
 
 	struct
 	{
-		size_t index;
+		const cmdtab_entry_t *entry;
 		union
 		{
 			struct
@@ -90,23 +111,87 @@ typedef struct console
 			} sleep;
 		} context;
 	} command;
+
+	struct
+	{
+		char buf[256];
+		size_t begin; ///< the bytes before it have been handed to the shell
+		size_t end;
+	} input;
+
+	struct
+	{
+		const char *path;
+		int fd; ///< -1 without a history file
+		size_t size;
+		unsigned int n_unsynced;
+	} histlog;
 } console_t;
 
-static emsh_block_t console_emsh_blocks[EMSH_MAX_HIST_SIZE];
+#if EMSH_ENABLE_RUNTIME_SIZE
+static char console_emsh_hist_mem[EMSH_MAX_HIST_SIZE * EMSH_HIST_ENTRY_SIZE(EMSH_MAX_LINE_SIZE)];
+static char console_emsh_line_mem[EMSH_LINE_MEM_SIZE(EMSH_MAX_LINE_SIZE)];
+static emsh_hist_slot_t console_emsh_hist_ring[EMSH_MAX_HIST_SIZE];
+#if EMSH_ENABLE_PREFIX_SEARCH
+static size_t console_emsh_hist_sorted[EMSH_MAX_HIST_SIZE];
+#endif
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+static size_t console_emsh_hist_hash[EMSH_HIST_HASH_SIZE(EMSH_MAX_HIST_SIZE)];
+#endif
+static emsh_iov_t console_emsh_args[EMSH_MAX_N_ARGS];
+static const char *console_emsh_argv[EMSH_MAX_N_ARGS];
+#else
+static char console_emsh_hist_mem[EMSH_HIST_MEM_SIZE];
+#endif
+#if EMSH_ENABLE_OUTPUT_BUFFER
+static char console_emsh_out_buf[256];
+#endif
 static console_t g_console;
 
-static void _console_write_char(uintptr_t cookie, char ch);
+static void console_exit(void);
+
 static void _console_write_strn(uintptr_t cookie, const char *str, size_t len);
-static void _console_exec(uintptr_t cookie, int argc, const char **argv);
+static void _console_exec(uintptr_t cookie, int argc, const emsh_iov_t *args);
+static void _console_flush(uintptr_t cookie);
+static void _console_hist_append(uintptr_t cookie, const char *line, size_t len);
+static uint32_t _console_now_ms(uintptr_t cookie);
+#if EMSH_ENABLE_COMPLETION && CMDTAB_ENABLE_COMPLETION
+static void _console_complete(uintptr_t cookie, emsh_completion_t *c);
+#endif
 
 static const emsh_conf_t console_emsh_conf = {
 	.cookie = (uintptr_t)&g_console,
 	.ops = {
-		.write_char = &_console_write_char,
 		.write_strn = &_console_write_strn,
-		.exec = &_console_exec,
+		.exec_spans = &_console_exec,
+		.flush = &_console_flush,
+		.hist_append = &_console_hist_append,
+#if EMSH_ENABLE_COMPLETION && CMDTAB_ENABLE_COMPLETION
+		.complete = &_console_complete,
+#endif
+		.now_ms = &_console_now_ms,
 	},
-	.blocks = console_emsh_blocks,
+	.hist_mem = console_emsh_hist_mem,
+#if EMSH_ENABLE_RUNTIME_SIZE
+	.hist_mem_size = sizeof(console_emsh_hist_mem),
+	.hist_ring = console_emsh_hist_ring,
+#if EMSH_ENABLE_PREFIX_SEARCH
+	.hist_sorted = console_emsh_hist_sorted,
+#endif
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+	.hist_hash = console_emsh_hist_hash,
+#endif
+	.max_hist_size = EMSH_MAX_HIST_SIZE,
+	.line_mem = console_emsh_line_mem,
+	.max_line_size = EMSH_MAX_LINE_SIZE,
+	.args = console_emsh_args,
+	.argv = console_emsh_argv,
+	.max_n_args = EMSH_MAX_N_ARGS,
+#endif
+#if EMSH_ENABLE_OUTPUT_BUFFER
+	.out_buf = console_emsh_out_buf,
+	.out_buf_size = sizeof(console_emsh_out_buf),
+#endif
 };
 
 /*
@@ -116,95 +201,343 @@ static const emsh_conf_t console_emsh_conf = {
 #define CONSOLE_COMMAND_TASK_DONE 0
 #define CONSOLE_COMMAND_TASK_CONT 1
 
-typedef struct console_command
+/// the data of a command entry that returns CONSOLE_COMMAND_TASK_CONT
+typedef struct console_command_task
 {
-	const char *name;
-	int (*entry)(int argc, const char **argv);
 	int (*task)(void);
-} console_command_t;
+} console_command_task_t;
 
 static int console__echo(int argc, const char **argv);
 static int console__sleep(int argc, const char **argv);
 static int console__sleep_task(void);
 static int console__greet(int argc, const char **argv);
+static void console__greet_complete(int index, const char *word, size_t len, cmdtab_add_t *add, void *ctx);
 static int console__exit(int argc, const char **argv);
 
-// keep sorted by name
-static const console_command_t console_commands[] = {
-	{"echo", &console__echo, NULL},
-	{"exit", &console__exit, NULL},
-	{"greet", &console__greet, NULL},
-	{"sleep", &console__sleep, &console__sleep_task},
-};
+static const console_command_task_t console__sleep_cont = {&console__sleep_task};
 
-#define CONSOLE_COMMANDS_SIZE (sizeof(console_commands)/sizeof(*console_commands))
+CMDTAB_REGISTER(echo, "echo", &console__echo, NULL);
+CMDTAB_REGISTER(exit, "exit", &console__exit, NULL);
+CMDTAB_REGISTER_COMPLETE(greet, "greet", &console__greet, NULL, &console__greet_complete);
+CMDTAB_REGISTER(sleep, "sleep", &console__sleep, &console__sleep_cont);
 
 /*
  * framework functions
  */
 
-static void _console_write_char(uintptr_t cookie, char ch)
+static void _console_write_strn(uintptr_t cookie, const char *str, size_t len)
 {
 	(void)cookie;
-	console_write_char(ch);
+	console_write_strn(str, len);
 }
 
-static void _console_write_strn(uintptr_t cookie, const char *str, size_t len)
+static void _console_flush(uintptr_t cookie)
 {
 	(void)cookie;
-	console_write_strn(str, len);
+	console_flush();
+}
+
+/// the input is read blocking, so a lone ESC is resolved when the next chunk arrives
+static uint32_t _console_now_ms(uintptr_t cookie)
+{
+	struct timespec ts;
+
+	(void)cookie;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec * 1000u + (uint32_t)(ts.tv_nsec / 1000000);
+}
+
+#if EMSH_ENABLE_COMPLETION && CMDTAB_ENABLE_COMPLETION
+static void console_complete_add(void *ctx, const char *str, size_t len, size_t n)
+{
+	emsh_complete_add(ctx, str, len, n);
 }
 
-static void console_check_preconditions(void)
+static void _console_complete(uintptr_t cookie, emsh_completion_t *c)
 {
-#if 1
-	if (CONSOLE_COMMANDS_SIZE > 1)
+	(void)cookie;
+
+	if (c->index == 0)
 	{
-		for (size_t i = 0; i < CONSOLE_COMMANDS_SIZE - 1; ++i)
+		cmdtab_complete(c->word, c->len, c->list, &console_complete_add, c);
+	}
+	else
+	{
+		const cmdtab_entry_t *entry = cmdtab_find(c->args[0].base, c->args[0].len);
+		if (entry != NULL && entry->complete != NULL)
 		{
-			assert(strcmp(console_commands[i].name, console_commands[i+1].name) < 0);
+			entry->complete(c->index, c->word, c->len, &console_complete_add, c);
 		}
 	}
+}
 #endif
+
+/*
+ * history log
+ *
+ * rec := len (2 bytes) | crc32 of the characters (4 bytes) | characters | len (2 bytes)
+ *
+ * An append-only file of records in little endian. Thanks to the trailing
+ * length, the newest records are found from the end of the file, so that
+ * loading costs O(history size) however long the log grows. A record torn by
+ * a crash fails its checksum and gets truncated away.
+ */
+
+#define CONSOLE_HISTLOG_REC_SIZE(_len) ((_len) + 8)
+#define CONSOLE_HISTLOG_SYNC_INTERVAL 8 ///< appends per fsync
+#define CONSOLE_HISTLOG_MAX_SIZE (64 * 1024) ///< compacted beyond this
+
+static size_t console_histlog_get16(const unsigned char *p)
+{
+	return (size_t)p[0] | (size_t)p[1] << 8;
+}
+
+static uint32_t console_histlog_get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void console_histlog_put16(unsigned char *p, size_t val)
+{
+	p[0] = (unsigned char)(val & 0xFF);
+	p[1] = (unsigned char)(val >> 8);
+}
+
+static void console_histlog_put32(unsigned char *p, uint32_t val)
+{
+	for (int i = 0; i < 4; ++i)
+	{
+		p[i] = (unsigned char)(val >> (8 * i));
+	}
+}
+
+static uint32_t console_histlog_crc32(const unsigned char *p, size_t n)
+{
+	uint32_t crc = 0xFFFFFFFFu;
+	for (size_t i = 0; i < n; ++i)
+	{
+		crc ^= p[i];
+		for (int k = 0; k < 8; ++k)
+		{
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+		}
+	}
+	return ~crc;
+}
+
+/// checks the record ending at end; stores its beginning in *p_begin
+static int console_histlog_check_before(const unsigned char *map, size_t end, size_t *p_begin)
+{
+	if (end < CONSOLE_HISTLOG_REC_SIZE(0))
+	{
+		return -1;
+	}
+
+	size_t len = console_histlog_get16(&map[end - 2]);
+	if (end < CONSOLE_HISTLOG_REC_SIZE(len))
+	{
+		return -1;
+	}
+
+	size_t begin = end - CONSOLE_HISTLOG_REC_SIZE(len);
+	if (console_histlog_get16(&map[begin]) != len ||
+	    console_histlog_get32(&map[begin + 2]) != console_histlog_crc32(&map[begin + 6], len))
+	{
+		return -1;
+	}
+
+	*p_begin = begin;
+	return 0;
 }
 
-static int console_find_command(const char *name, size_t *p_index)
+/// the end of the valid records, scanning from the beginning (after a crash only)
+static size_t console_histlog_valid_size(const unsigned char *map, size_t size)
 {
-	size_t i_begin = 0;
-	size_t i_end = CONSOLE_COMMANDS_SIZE;
-	size_t i_mid = i_end / 2;
-	while (i_begin < i_end)
+	size_t end = 0;
+	size_t begin;
+	while (end + CONSOLE_HISTLOG_REC_SIZE(0) <= size)
 	{
-		int cmp = strcmp(name, console_commands[i_mid].name);
-		if (cmp < 0)
+		size_t next = end + CONSOLE_HISTLOG_REC_SIZE(console_histlog_get16(&map[end]));
+		if (next > size || console_histlog_check_before(map, next, &begin) != 0 || begin != end)
 		{
-			i_end = i_mid;
+			break;
 		}
-		else if (cmp > 0)
+		end = next;
+	}
+	return end;
+}
+
+/// finds [*p_begin, *p_end), the newest max_n valid records
+static void console_histlog_find_tail(const unsigned char *map, size_t size, size_t max_n,
+                                      size_t *p_begin, size_t *p_end)
+{
+	size_t begin;
+	size_t end = size;
+	if (end != 0 && console_histlog_check_before(map, end, &begin) != 0)
+	{
+		end = console_histlog_valid_size(map, size);
+	}
+
+	size_t tail = end;
+	for (size_t n = 0; n < max_n && console_histlog_check_before(map, tail, &begin) == 0; ++n)
+	{
+		tail = begin;
+	}
+
+	*p_begin = tail;
+	*p_end = end;
+}
+
+/// restores the history from the log at path, which gets created if missing
+static int console_histlog_open(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	size_t size = (size_t)st.st_size;
+	size_t end = 0;
+	if (size != 0)
+	{
+		const unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+		{
+			close(fd);
+			return -1;
+		}
+
+		size_t begin;
+		console_histlog_find_tail(map, size, EMSH_MAX_HIST_SIZE, &begin, &end);
+		while (begin != end)
+		{
+			size_t len = console_histlog_get16(&map[begin]);
+			emsh_hist_push(&g_console.emsh, (const char *)&map[begin + 6], len);
+			begin += CONSOLE_HISTLOG_REC_SIZE(len);
+		}
+		munmap((void *)map, size);
+
+		if (end != size && ftruncate(fd, (off_t)end) != 0)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+
+	g_console.histlog.path = path;
+	g_console.histlog.fd = fd;
+	g_console.histlog.size = end;
+	g_console.histlog.n_unsynced = 0;
+	return 0;
+}
+
+/// rewrites the log with the records which are still in the history;
+/// costs O(history size) and runs once per CONSOLE_HISTLOG_MAX_SIZE bytes logged
+static void console_histlog_compact(void)
+{
+	size_t size = g_console.histlog.size;
+	const unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, g_console.histlog.fd, 0);
+	if (map == MAP_FAILED)
+	{
+		return;
+	}
+
+	size_t begin, end;
+	console_histlog_find_tail(map, size, EMSH_MAX_HIST_SIZE, &begin, &end);
+
+	char tmp_path[256];
+	int fd = -1;
+	if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_console.histlog.path) < sizeof(tmp_path))
+	{
+		fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	}
+	if (fd != -1)
+	{
+		if (write(fd, &map[begin], end - begin) == (ssize_t)(end - begin) &&
+		    fsync(fd) == 0 &&
+		    rename(tmp_path, g_console.histlog.path) == 0)
 		{
-			i_begin = i_mid + 1;
+			close(g_console.histlog.fd);
+			g_console.histlog.fd = open(g_console.histlog.path, O_RDWR | O_APPEND);
+			g_console.histlog.size = end - begin;
+			g_console.histlog.n_unsynced = 0;
 		}
 		else
 		{
-			*p_index = i_mid;
-			return 0;
+			unlink(tmp_path);
 		}
-		i_mid = (i_end - i_begin) / 2 + i_begin;
+		close(fd);
+	}
+	munmap((void *)map, size);
+}
+
+static void console_histlog_close(void)
+{
+	if (g_console.histlog.fd != -1)
+	{
+		fsync(g_console.histlog.fd);
+		close(g_console.histlog.fd);
+		g_console.histlog.fd = -1;
 	}
-	return -1;
 }
 
-static void _console_exec(uintptr_t cookie, int argc, const char **argv)
+static void _console_hist_append(uintptr_t cookie, const char *line, size_t len)
 {
 	(void)cookie;
 
-	int r = console_find_command(argv[0], &g_console.command.index);
-	if (r == 0)
+	if (g_console.histlog.fd == -1)
 	{
-		r = console_commands[g_console.command.index].entry(argc, argv);
+		return;
+	}
+
+	unsigned char head[6];
+	unsigned char trail[2];
+	console_histlog_put16(head, len);
+	console_histlog_put32(&head[2], console_histlog_crc32((const unsigned char *)line, len));
+	console_histlog_put16(trail, len);
+
+	struct iovec iov[] = {
+		{.iov_base = head, .iov_len = sizeof(head)},
+		{.iov_base = (void *)line, .iov_len = len},
+		{.iov_base = trail, .iov_len = sizeof(trail)},
+	};
+	if (writev(g_console.histlog.fd, iov, 3) != (ssize_t)CONSOLE_HISTLOG_REC_SIZE(len))
+	{
+		console_histlog_close(); // keep the log consistent by giving up on it
+		return;
+	}
+	g_console.histlog.size += CONSOLE_HISTLOG_REC_SIZE(len);
+
+	if (++g_console.histlog.n_unsynced == CONSOLE_HISTLOG_SYNC_INTERVAL)
+	{
+		fsync(g_console.histlog.fd);
+		g_console.histlog.n_unsynced = 0;
+	}
+	if (g_console.histlog.size > CONSOLE_HISTLOG_MAX_SIZE)
+	{
+		console_histlog_compact();
+	}
+}
+
+static void _console_exec(uintptr_t cookie, int argc, const emsh_iov_t *args)
+{
+	(void)cookie;
+
+	g_console.command.entry = cmdtab_find(args[0].base, args[0].len);
+	if (g_console.command.entry != NULL)
+	{
+		int r = g_console.command.entry->func(argc, emsh_argv(&g_console.emsh));
 		if (r == CONSOLE_COMMAND_TASK_CONT)
 		{
-			assert(console_commands[g_console.command.index].task != NULL);
+			assert(g_console.command.entry->data != NULL);
 			emsh_stop(&g_console.emsh);
 		}
 	}
@@ -216,18 +549,27 @@ static void _console_exec(uintptr_t cookie, int argc, const char **argv)
 
 static int console_command_task(void)
 {
-	assert(g_console.command.index < CONSOLE_COMMANDS_SIZE);
-	assert(console_commands[g_console.command.index].task != NULL);
-	return console_commands[g_console.command.index].task();
+	const console_command_task_t *cont = g_console.command.entry->data;
+	return cont->task();
 }
 
-static void console_init(void)
+/// -1 if the command table can't be built
+static int console_init(void)
 {
-	console_check_preconditions();
+	if (cmdtab_init() != 0)
+	{
+		fprintf(stderr, "console: a command is registered twice or there are too many commands\n");
+		return -1;
+	}
 
 	g_console.running = 1;
 	g_console.state = CONSOLE_STATE_INIT;
+	g_console.input.begin = 0;
+	g_console.input.end = 0;
+	g_console.histlog.fd = -1;
+	console_set_raw();
 	emsh_init(&g_console.emsh, &console_emsh_conf);
+	return 0;
 }
 
 static void console_task(void)
@@ -245,15 +587,24 @@ static void console_task(void)
 
 			case CONSOLE_STATE_SHELL:
 			{
-				int c = console_read_char();
-				if (c != EOF)
+				if (g_console.input.begin == g_console.input.end)
 				{
-					emsh_task(&g_console.emsh, c);
-					if (!emsh_running(&g_console.emsh))
+					g_console.input.begin = 0;
+					g_console.input.end = console_read(g_console.input.buf, sizeof(g_console.input.buf));
+					if (g_console.input.end == 0)
 					{
-						g_console.state = CONSOLE_STATE_COMMAND;
+						console_exit();
+						break;
 					}
 				}
+
+				// the rest is kept for the shell when a command stops it
+				g_console.input.begin += emsh_task_n(&g_console.emsh, &g_console.input.buf[g_console.input.begin],
+				                                     g_console.input.end - g_console.input.begin);
+				if (!emsh_running(&g_console.emsh))
+				{
+					g_console.state = CONSOLE_STATE_COMMAND;
+				}
 			}
 			break;
 
@@ -278,6 +629,8 @@ static int console_running(void)
 static void console_exit(void)
 {
 	emsh_stop(&g_console.emsh);
+	console_histlog_close();
+	console_restore_mode();
 	g_console.running = 0;
 }
 
@@ -380,6 +733,19 @@ static int console__greet(int argc, const char **argv)
 	return CONSOLE_COMMAND_TASK_DONE;
 }
 
+static void console__greet_complete(int index, const char *word, size_t len, cmdtab_add_t *add, void *ctx)
+{
+	static const char *const opts[] = {"-a", "-c", "-e", "-m", "-n"};
+
+	(void)index;
+	(void)word;
+	(void)len;
+	for (size_t i = 0; i < sizeof(opts)/sizeof(*opts); ++i)
+	{
+		add(ctx, opts[i], 2, 1);
+	}
+}
+
 static int console__exit(int argc, const char **argv)
 {
 	(void)argc;
@@ -392,9 +758,16 @@ static int console__exit(int argc, const char **argv)
  * console thread
  */
 
-int main()
+int main(int argc, char **argv)
 {
-	console_init();
+	if (console_init() != 0)
+	{
+		return 1;
+	}
+	if (argc > 1 && console_histlog_open(argv[1]) != 0)
+	{
+		perror(argv[1]);
+	}
 
 	while (console_running())
 	{
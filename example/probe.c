@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: BSL-1.0
+
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+// Feeds lines to a shell and checks the arguments they run with.
+// Exits with 1 if any probe fails.
+
+#include "emsh.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * shell under probe
+ */
+
+typedef struct probe
+{
+	emsh_t emsh;
+	char argv[256]; ///< the arguments of the last command, separated by '|'
+	size_t len;
+} probe_t;
+
+static char probe_hist_mem[EMSH_HIST_MEM_SIZE];
+static probe_t g_probe;
+
+static void _probe_write_strn(uintptr_t cookie, const char *str, size_t len)
+{
+	(void)cookie;
+	(void)str;
+	(void)len;
+}
+
+static void _probe_exec(uintptr_t cookie, int argc, const emsh_iov_t *args)
+{
+	probe_t *self = (probe_t *)cookie;
+
+	self->len = 0;
+	for (int i = 0; i < argc; ++i)
+	{
+		if (i != 0 && self->len < sizeof(self->argv))
+		{
+			self->argv[self->len++] = '|';
+		}
+		size_t n = args[i].len < sizeof(self->argv) - self->len ? args[i].len : sizeof(self->argv) - self->len;
+		memcpy(&self->argv[self->len], args[i].base, n);
+		self->len += n;
+	}
+}
+
+static const emsh_conf_t probe_emsh_conf = {
+	.cookie = (uintptr_t)&g_probe,
+	.ops = {
+		.write_strn = &_probe_write_strn,
+		.exec_spans = &_probe_exec,
+	},
+	.hist_mem = probe_hist_mem,
+};
+
+/*
+ * probes
+ */
+
+typedef struct probe_case
+{
+	const char *line;
+	const char *argv; ///< expected, "" if nothing runs
+} probe_case_t;
+
+/// run in order on one shell, so that each sees the history of the ones before
+static const probe_case_t probe_cases[] = {
+	// quoting
+	{"echo one two", "echo|one|two"},
+	{"echo 'a b' \"c d\"", "echo|a b|c d"},
+	{"echo a\\ b 'c\\d' \"e\\\"f\\g\"", "echo|a b|c\\d|e\"f\\g"},
+	{"echo 'a", ""},
+	// history expansion
+	{"echo one", "echo|one"},
+	{"echo !!", "echo|echo|one"},
+	{"echo '!!'", "echo|!!"},
+	{"echo \"!!\"", "echo|echo '!!'"},
+	{"echo 'a!!b'", "echo|a!!b"},
+	{"echo \\!!", "echo|!!"},
+	{"echo \"\\!!\"", "echo|\\!!"},
+	{"echo '\\'!!", "echo|\\echo|\\!!"},
+	{"echo !-2", "echo|echo|\\!!"},
+};
+
+int main(void)
+{
+	int n_failed = 0;
+
+	emsh_init(&g_probe.emsh, &probe_emsh_conf);
+	emsh_start(&g_probe.emsh);
+
+	for (size_t i = 0; i < sizeof(probe_cases)/sizeof(*probe_cases); ++i)
+	{
+		const probe_case_t *c = &probe_cases[i];
+
+		g_probe.len = 0;
+		emsh_task_n(&g_probe.emsh, c->line, strlen(c->line));
+		emsh_task(&g_probe.emsh, '\n');
+
+		bool ok = (g_probe.len == strlen(c->argv) && memcmp(g_probe.argv, c->argv, g_probe.len) == 0);
+		if (!ok)
+		{
+			fprintf(stdout, "FAIL %s: got %.*s, expected %s\n", c->line, (int)g_probe.len, g_probe.argv, c->argv);
+			++n_failed;
+		}
+	}
+
+	fprintf(stdout, "%d of %d probes failed\n", n_failed, (int)(sizeof(probe_cases)/sizeof(*probe_cases)));
+	return n_failed != 0;
+}
@@ -7,6 +7,22 @@
 #if !defined(ASCII_H_INCLUDED)
 #define ASCII_H_INCLUDED
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(ASCII_ENABLE_SIMD)
+  #define ASCII_ENABLE_SIMD 1 ///< scan buffers with SSE2 (and AVX2) or NEON when the target has them
+#endif
+
+#if ASCII_ENABLE_SIMD && defined(__AVX2__)
+  #include <immintrin.h>
+#elif ASCII_ENABLE_SIMD && defined(__SSE2__)
+  #include <emmintrin.h>
+#elif ASCII_ENABLE_SIMD && defined(__ARM_NEON) && defined(__aarch64__)
+  #include <arm_neon.h>
+#endif
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -194,6 +210,309 @@ int ascii_toascii(int c)
 #define ASCII_CNTRL(c) (((c) - 0x40) & 0x7F)
 #define ASCII_UNCNTRL(c) (((c) + 0x40) & 0x7F)
 
+/*
+ * classes, which combine into masks (e.g. UPPER|LOWER for alpha)
+ */
+
+#define ASCII_CLASS_CNTRL 0x01
+#define ASCII_CLASS_PRINT 0x02
+#define ASCII_CLASS_SPACE 0x04
+#define ASCII_CLASS_BLANK 0x08
+#define ASCII_CLASS_PUNCT 0x10
+#define ASCII_CLASS_DIGIT 0x20
+#define ASCII_CLASS_UPPER 0x40
+#define ASCII_CLASS_LOWER 0x80
+
+/// the classes of the byte c (0 for the bytes above 0x7F)
+static inline
+unsigned ascii_class(unsigned char c)
+{
+	static const unsigned char table[256] = {
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x0D, 0x05, 0x05, 0x05, 0x05, 0x01, 0x01, // 0x00
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 0x10
+		0x0E, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, // 0x20
+		0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, // 0x30
+		0x12, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, // 0x40
+		0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x12, 0x12, 0x12, 0x12, 0x12, // 0x50
+		0x12, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, // 0x60
+		0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x12, 0x12, 0x12, 0x12, 0x01, // 0x70
+		// 0x80-0xFF: none
+	};
+	return table[c];
+}
+
+/*
+ * buffers
+ */
+
+///@internal word-at-a-time helpers: each byte of the result has its top bit set when the byte of x matches
+#define ASCII_IMPL_ONES ((size_t)-1 / 0xFF)
+
+static inline
+size_t ascii_impl_swar_cntrl(size_t x)
+{
+	size_t y = x & (ASCII_IMPL_ONES * 0x7F);
+	return (~(y + ASCII_IMPL_ONES * 0x60) | (y + ASCII_IMPL_ONES * 0x01)) & ~x & (ASCII_IMPL_ONES * 0x80);
+}
+
+static inline
+size_t ascii_impl_swar_nonprint(size_t x)
+{
+	size_t y = x & (ASCII_IMPL_ONES * 0x7F);
+	return (~(y + ASCII_IMPL_ONES * 0x60) | (y + ASCII_IMPL_ONES * 0x01) | x) & (ASCII_IMPL_ONES * 0x80);
+}
+
+/// offset of the first control character in buf, n if there is none
+static inline
+size_t ascii_find_first_cntrl(const char *buf, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	size_t i = 0;
+
+#if ASCII_ENABLE_SIMD && defined(__AVX2__)
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i *)&p[i]);
+		__m256i lo = _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), x), _mm256_cmpgt_epi8(x, _mm256_set1_epi8(-1)));
+		unsigned bits = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(lo, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(0x7F))));
+		if (bits != 0)
+		{
+			return i + (size_t)__builtin_ctz(bits);
+		}
+	}
+#endif
+#if ASCII_ENABLE_SIMD && defined(__SSE2__)
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)&p[i]);
+		__m128i lo = _mm_and_si128(_mm_cmplt_epi8(x, _mm_set1_epi8(0x20)), _mm_cmpgt_epi8(x, _mm_set1_epi8(-1)));
+		unsigned bits = (unsigned)_mm_movemask_epi8(_mm_or_si128(lo, _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7F))));
+		if (bits != 0)
+		{
+			return i + (size_t)__builtin_ctz(bits);
+		}
+	}
+#elif ASCII_ENABLE_SIMD && defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 16 <= n; i += 16)
+	{
+		uint8x16_t x = vld1q_u8(&p[i]);
+		uint8x16_t m = vorrq_u8(vcltq_u8(x, vdupq_n_u8(0x20)), vceqq_u8(x, vdupq_n_u8(0x7F)));
+		// 4 bits per byte
+		uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+		if (bits != 0)
+		{
+			return i + (size_t)__builtin_ctzll(bits) / 4;
+		}
+	}
+#else
+	for (; i + sizeof(size_t) <= n; i += sizeof(size_t))
+	{
+		size_t x;
+		memcpy(&x, &p[i], sizeof(x));
+		if (ascii_impl_swar_cntrl(x) != 0)
+		{
+			break; // found within this word
+		}
+	}
+#endif
+	for (; i < n; ++i)
+	{
+		if (ascii_class(p[i]) & ASCII_CLASS_CNTRL)
+		{
+			break;
+		}
+	}
+	return i;
+}
+
+/// length of the run of printable characters at the start of buf
+static inline
+size_t ascii_span_print(const char *buf, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	size_t i = 0;
+
+#if ASCII_ENABLE_SIMD && defined(__AVX2__)
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i *)&p[i]);
+		__m256i m = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8(0x1F)), _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7F), x));
+		unsigned bits = ~(unsigned)_mm256_movemask_epi8(m);
+		if (bits != 0)
+		{
+			return i + (size_t)__builtin_ctz(bits);
+		}
+	}
+#endif
+#if ASCII_ENABLE_SIMD && defined(__SSE2__)
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)&p[i]);
+		__m128i m = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(0x1F)), _mm_cmplt_epi8(x, _mm_set1_epi8(0x7F)));
+		unsigned bits = ~(unsigned)_mm_movemask_epi8(m) & 0xFFFF;
+		if (bits != 0)
+		{
+			return i + (size_t)__builtin_ctz(bits);
+		}
+	}
+#elif ASCII_ENABLE_SIMD && defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 16 <= n; i += 16)
+	{
+		uint8x16_t x = vld1q_u8(&p[i]);
+		uint8x16_t m = vorrq_u8(vcltq_u8(x, vdupq_n_u8(0x20)), vcgtq_u8(x, vdupq_n_u8(0x7E)));
+		// 4 bits per byte
+		uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+		if (bits != 0)
+		{
+			return i + (size_t)__builtin_ctzll(bits) / 4;
+		}
+	}
+#else
+	for (; i + sizeof(size_t) <= n; i += sizeof(size_t))
+	{
+		size_t x;
+		memcpy(&x, &p[i], sizeof(x));
+		if (ascii_impl_swar_nonprint(x) != 0)
+		{
+			break; // ends within this word
+		}
+	}
+#endif
+	for (; i < n; ++i)
+	{
+		if (!(ascii_class(p[i]) & ASCII_CLASS_PRINT))
+		{
+			break;
+		}
+	}
+	return i;
+}
+
+///@internal the byte ranges making up the classes in mask, at most ASCII_IMPL_MAX_RANGES
+#define ASCII_IMPL_MAX_RANGES 14
+
+static inline
+size_t ascii_impl_class_ranges(unsigned mask, unsigned char lo[ASCII_IMPL_MAX_RANGES], unsigned char hi[ASCII_IMPL_MAX_RANGES])
+{
+	static const struct
+	{
+		unsigned char cls;
+		unsigned char lo;
+		unsigned char hi;
+	} ranges[ASCII_IMPL_MAX_RANGES] = {
+		{ASCII_CLASS_CNTRL, 0x00, 0x1F}, {ASCII_CLASS_CNTRL, 0x7F, 0x7F},
+		{ASCII_CLASS_PRINT, 0x20, 0x7E},
+		{ASCII_CLASS_SPACE, 0x09, 0x0D}, {ASCII_CLASS_SPACE, 0x20, 0x20},
+		{ASCII_CLASS_BLANK, 0x09, 0x09}, {ASCII_CLASS_BLANK, 0x20, 0x20},
+		{ASCII_CLASS_PUNCT, 0x21, 0x2F}, {ASCII_CLASS_PUNCT, 0x3A, 0x40}, {ASCII_CLASS_PUNCT, 0x5B, 0x60}, {ASCII_CLASS_PUNCT, 0x7B, 0x7E},
+		{ASCII_CLASS_DIGIT, 0x30, 0x39},
+		{ASCII_CLASS_UPPER, 0x41, 0x5A},
+		{ASCII_CLASS_LOWER, 0x61, 0x7A},
+	};
+	size_t n = 0;
+
+	for (size_t i = 0; i < ASCII_IMPL_MAX_RANGES; ++i)
+	{
+		if (ranges[i].cls & mask)
+		{
+			lo[n] = ranges[i].lo;
+			hi[n] = ranges[i].hi;
+			++n;
+		}
+	}
+	return n;
+}
+
+/// number of bytes in buf belonging to any of the classes in mask
+static inline
+size_t ascii_count_class(const char *buf, size_t n, unsigned mask)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	unsigned char lo[ASCII_IMPL_MAX_RANGES];
+	unsigned char hi[ASCII_IMPL_MAX_RANGES];
+	size_t n_ranges = ascii_impl_class_ranges(mask, lo, hi);
+	size_t count = 0;
+	size_t i = 0;
+
+	// each block ORs the range compares of its bytes; the per-byte counts are summed before they reach 255
+#if ASCII_ENABLE_SIMD && defined(__AVX2__)
+	while (i + 32 <= n)
+	{
+		__m256i acc = _mm256_setzero_si256();
+		for (size_t k = 0; k < 255 && i + 32 <= n; ++k, i += 32)
+		{
+			__m256i x = _mm256_loadu_si256((const __m256i *)&p[i]);
+			__m256i m = _mm256_setzero_si256();
+			for (size_t r = 0; r < n_ranges; ++r)
+			{
+				__m256i ge = _mm256_cmpgt_epi8(x, _mm256_set1_epi8((char)(lo[r] - 1)));
+				m = _mm256_or_si256(m, _mm256_andnot_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8((char)hi[r])), ge));
+			}
+			acc = _mm256_sub_epi8(acc, m);
+		}
+		__m256i sum = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+		__m128i sum2 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+		count += (size_t)_mm_cvtsi128_si32(sum2) + (size_t)_mm_extract_epi16(sum2, 4);
+	}
+#endif
+#if ASCII_ENABLE_SIMD && defined(__SSE2__)
+	while (i + 16 <= n)
+	{
+		__m128i acc = _mm_setzero_si128();
+		for (size_t k = 0; k < 255 && i + 16 <= n; ++k, i += 16)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i *)&p[i]);
+			__m128i m = _mm_setzero_si128();
+			for (size_t r = 0; r < n_ranges; ++r)
+			{
+				__m128i ge = _mm_cmpgt_epi8(x, _mm_set1_epi8((char)(lo[r] - 1)));
+				m = _mm_or_si128(m, _mm_andnot_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8((char)hi[r])), ge));
+			}
+			acc = _mm_sub_epi8(acc, m);
+		}
+		__m128i sum = _mm_sad_epu8(acc, _mm_setzero_si128());
+		count += (size_t)_mm_cvtsi128_si32(sum) + (size_t)_mm_extract_epi16(sum, 4);
+	}
+#elif ASCII_ENABLE_SIMD && defined(__ARM_NEON) && defined(__aarch64__)
+	while (i + 16 <= n)
+	{
+		uint8x16_t acc = vdupq_n_u8(0);
+		for (size_t k = 0; k < 255 && i + 16 <= n; ++k, i += 16)
+		{
+			uint8x16_t x = vld1q_u8(&p[i]);
+			uint8x16_t m = vdupq_n_u8(0);
+			for (size_t r = 0; r < n_ranges; ++r)
+			{
+				m = vorrq_u8(m, vandq_u8(vcgeq_u8(x, vdupq_n_u8(lo[r])), vcleq_u8(x, vdupq_n_u8(hi[r]))));
+			}
+			acc = vsubq_u8(acc, m);
+		}
+		count += vaddlvq_u8(acc);
+	}
+#else
+	for (; i + sizeof(size_t) <= n; i += sizeof(size_t))
+	{
+		size_t x;
+		memcpy(&x, &p[i], sizeof(x));
+
+		// the top bit of each byte: y >= lo and not y > hi, for the bytes up to 0x7F
+		size_t y = x & (ASCII_IMPL_ONES * 0x7F);
+		size_t m = 0;
+		for (size_t r = 0; r < n_ranges; ++r)
+		{
+			m |= (y + ASCII_IMPL_ONES * (size_t)(0x80 - lo[r])) & ~(y + ASCII_IMPL_ONES * (size_t)(0x7F - hi[r]));
+		}
+		m &= ~x & (ASCII_IMPL_ONES * 0x80);
+		count += ((m >> 7) * ASCII_IMPL_ONES) >> ((sizeof(size_t) - 1) * 8);
+	}
+#endif
+	for (; i < n; ++i)
+	{
+		count += (ascii_class(p[i]) & mask) != 0;
+	}
+	return count;
+}
+
 #if defined(__cplusplus)
 }
 #endif
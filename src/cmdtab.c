@@ -0,0 +1,379 @@
+// SPDX-License-Identifier: BSL-1.0
+
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#include "cmdtab.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Hash and displace
+ *
+ * A name is hashed once. The hash picks a bucket, and the displacement of the
+ * bucket, mixed with the hash, picks the slot of the entry:
+ *
+ *   slot = mix(hash ^ disp[hash % n_buckets] * K) % n
+ *
+ * cmdtab_init() searches the displacements bucket by bucket, the largest
+ * buckets first, so that each of the n slots gets exactly one entry. Hence a
+ * lookup costs one pass over the name and one comparison, whatever the order
+ * in which the linker gathered the entries.
+ */
+
+#if defined(__APPLE__)
+extern const cmdtab_entry_t cmdtab_impl_begin[] __asm("section$start$__DATA$cmdtab");
+extern const cmdtab_entry_t cmdtab_impl_end[] __asm("section$end$__DATA$cmdtab");
+#else
+extern const cmdtab_entry_t __start_cmdtab[];
+extern const cmdtab_entry_t __stop_cmdtab[];
+#define cmdtab_impl_begin __start_cmdtab
+#define cmdtab_impl_end __stop_cmdtab
+#endif
+
+#define CMDTAB_N_BUCKETS(n) ((n) / 2 + 1)
+#define CMDTAB_MAX_DISP 0xFFFF
+
+static struct
+{
+	size_t n;
+	size_t n_buckets;
+	uint16_t disp[CMDTAB_N_BUCKETS(CMDTAB_MAX_SIZE)];
+	uint16_t slots[CMDTAB_MAX_SIZE]; ///< index of the entry in each slot
+} cmdtab_index;
+
+// only used while building the indexes
+static struct
+{
+	uint32_t hashes[CMDTAB_MAX_SIZE];
+	uint16_t members[CMDTAB_MAX_SIZE]; ///< entries grouped by bucket, then sorted by name
+	uint16_t begin[CMDTAB_N_BUCKETS(CMDTAB_MAX_SIZE) + 1]; ///< of the group of each bucket
+	uint16_t cur[CMDTAB_N_BUCKETS(CMDTAB_MAX_SIZE)];
+	bool taken[CMDTAB_MAX_SIZE];
+} cmdtab_build;
+
+#if CMDTAB_ENABLE_COMPLETION
+#define CMDTAB_NONE 0xFFFF
+
+typedef struct cmdtab_node
+{
+	uint16_t name; ///< entry of a name going through the node
+	uint16_t end; ///< of the label in that name
+	uint16_t entry; ///< whose name ends at the node, CMDTAB_NONE for none
+	uint16_t child; ///< the first one
+	uint16_t n_children;
+	uint16_t n_entries; ///< in the subtree
+} cmdtab_node_t;
+
+static struct
+{
+	size_t n_nodes; ///< 0 until built
+	cmdtab_node_t nodes[2 * CMDTAB_MAX_SIZE];
+} cmdtab_tree;
+#endif
+
+/// FNV-1a
+static uint32_t cmdtab_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < len; ++i)
+	{
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static size_t cmdtab_slot(uint32_t h, unsigned disp, size_t n)
+{
+	h ^= (uint32_t)disp * 0x9E3779B9u;
+	h ^= h >> 16;
+	h *= 0x85EBCA6Bu;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+
+	return h % n;
+}
+
+/// finds the displacement putting the members of bucket in free slots; false if there's none
+static bool cmdtab_place(size_t bucket)
+{
+	const uint16_t *members = &cmdtab_build.members[cmdtab_build.begin[bucket]];
+	size_t size = (size_t)(cmdtab_build.begin[bucket + 1] - cmdtab_build.begin[bucket]);
+
+	for (unsigned disp = 0; disp <= CMDTAB_MAX_DISP; ++disp)
+	{
+		size_t i;
+
+		for (i = 0; i < size; ++i)
+		{
+			size_t slot = cmdtab_slot(cmdtab_build.hashes[members[i]], disp, cmdtab_index.n);
+			if (cmdtab_build.taken[slot])
+			{
+				break;
+			}
+			cmdtab_build.taken[slot] = true;
+			cmdtab_index.slots[slot] = members[i];
+		}
+		if (i == size)
+		{
+			cmdtab_index.disp[bucket] = (uint16_t)disp;
+			return true;
+		}
+
+		// undo
+		while (i-- > 0)
+		{
+			cmdtab_build.taken[cmdtab_slot(cmdtab_build.hashes[members[i]], disp, cmdtab_index.n)] = false;
+		}
+	}
+
+	return false;
+}
+
+int cmdtab_init(void)
+{
+	size_t n = (size_t)(cmdtab_impl_end - cmdtab_impl_begin);
+	size_t n_buckets = CMDTAB_N_BUCKETS(n);
+	size_t max_size = 0;
+
+	cmdtab_index.n = 0;
+#if CMDTAB_ENABLE_COMPLETION
+	cmdtab_tree.n_nodes = 0;
+#endif
+	if (n == 0 || n > CMDTAB_MAX_SIZE)
+	{
+		return -1;
+	}
+
+	// group the entries by bucket
+	memset(cmdtab_build.begin, 0, sizeof(cmdtab_build.begin));
+	for (size_t i = 0; i < n; ++i)
+	{
+		const char *name = cmdtab_impl_begin[i].name;
+		cmdtab_build.hashes[i] = cmdtab_hash(name, strlen(name));
+		++cmdtab_build.begin[cmdtab_build.hashes[i] % n_buckets + 1];
+	}
+	for (size_t b = 0; b < n_buckets; ++b)
+	{
+		size_t size = cmdtab_build.begin[b + 1];
+		if (size > max_size)
+		{
+			max_size = size;
+		}
+		cmdtab_build.begin[b + 1] = (uint16_t)(cmdtab_build.begin[b] + size);
+		cmdtab_build.cur[b] = cmdtab_build.begin[b];
+	}
+	for (size_t i = 0; i < n; ++i)
+	{
+		cmdtab_build.members[cmdtab_build.cur[cmdtab_build.hashes[i] % n_buckets]++] = (uint16_t)i;
+	}
+
+	// a name registered twice lands twice in the same bucket
+	for (size_t b = 0; b < n_buckets; ++b)
+	{
+		for (size_t i = cmdtab_build.begin[b]; i < cmdtab_build.begin[b + 1]; ++i)
+		{
+			for (size_t j = i + 1; j < cmdtab_build.begin[b + 1]; ++j)
+			{
+				if (strcmp(cmdtab_impl_begin[cmdtab_build.members[i]].name, cmdtab_impl_begin[cmdtab_build.members[j]].name) == 0)
+				{
+					return -1;
+				}
+			}
+		}
+	}
+
+	// place the largest buckets first, while most slots are free
+	cmdtab_index.n = n;
+	cmdtab_index.n_buckets = n_buckets;
+	memset(cmdtab_index.disp, 0, sizeof(cmdtab_index.disp));
+	memset(cmdtab_build.taken, 0, sizeof(cmdtab_build.taken));
+	for (size_t size = max_size; size > 0; --size)
+	{
+		for (size_t b = 0; b < n_buckets; ++b)
+		{
+			if ((size_t)(cmdtab_build.begin[b + 1] - cmdtab_build.begin[b]) == size && !cmdtab_place(b))
+			{
+				cmdtab_index.n = 0;
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+const cmdtab_entry_t *cmdtab_find(const char *name, size_t len)
+{
+	if (cmdtab_index.n == 0)
+	{
+		return NULL; // cmdtab_init() failed
+	}
+
+	uint32_t h = cmdtab_hash(name, len);
+	const cmdtab_entry_t *entry = &cmdtab_impl_begin[cmdtab_index.slots[cmdtab_slot(h, cmdtab_index.disp[h % cmdtab_index.n_buckets], cmdtab_index.n)]];
+
+	if (strncmp(entry->name, name, len) != 0 || entry->name[len] != '\0')
+	{
+		return NULL;
+	}
+	return entry;
+}
+
+size_t cmdtab_size(void)
+{
+	return (size_t)(cmdtab_impl_end - cmdtab_impl_begin);
+}
+
+const cmdtab_entry_t *cmdtab_at(size_t i)
+{
+	assert(i < cmdtab_size());
+
+	return &cmdtab_impl_begin[i];
+}
+
+#if CMDTAB_ENABLE_COMPLETION
+/*
+ * Radix tree
+ *
+ * The label of a node is the part of the names of its subtree past the label
+ * of its parent, up to their longest common prefix. The children of a node
+ * are contiguous, in the order of their first character. A label isn't
+ * copied: the node refers to a name of its subtree and to the end of the
+ * label in it.
+ *
+ * The names starting with a prefix form the subtree reached by following the
+ * prefix from the root, and the path to the end of the label of its root is
+ * their longest common prefix.
+ */
+
+static const char *cmdtab_sorted_name(size_t i)
+{
+	return cmdtab_impl_begin[cmdtab_build.members[i]].name;
+}
+
+static int cmdtab_cmp(const void *a, const void *b)
+{
+	return strcmp(cmdtab_impl_begin[*(const uint16_t *)a].name, cmdtab_impl_begin[*(const uint16_t *)b].name);
+}
+
+/// builds the subtree of the sorted names [lo, hi), which share depth characters
+static void cmdtab_tree_build(size_t node, size_t lo, size_t hi, size_t depth)
+{
+	cmdtab_node_t *self = &cmdtab_tree.nodes[node];
+	const char *first = cmdtab_sorted_name(lo);
+	const char *last = cmdtab_sorted_name(hi - 1);
+	size_t end = depth;
+	size_t n_children = 0;
+
+	while (first[end] != '\0' && first[end] == last[end]) ++end;
+	assert(end <= 0xFFFF);
+
+	self->name = cmdtab_build.members[lo];
+	self->end = (uint16_t)end;
+	self->entry = CMDTAB_NONE;
+	self->n_entries = (uint16_t)(hi - lo);
+	if (first[end] == '\0')
+	{
+		self->entry = cmdtab_build.members[lo]; // sorted first as a prefix of the others
+		++lo;
+	}
+
+	for (size_t i = lo; i < hi; ++n_children)
+	{
+		char ch = cmdtab_sorted_name(i)[end];
+		while (i < hi && cmdtab_sorted_name(i)[end] == ch) ++i;
+	}
+	self->child = (uint16_t)cmdtab_tree.n_nodes;
+	self->n_children = (uint16_t)n_children;
+	cmdtab_tree.n_nodes += n_children;
+
+	for (size_t i = lo, child = self->child; i < hi; ++child)
+	{
+		size_t j = i;
+		char ch = cmdtab_sorted_name(i)[end];
+		while (j < hi && cmdtab_sorted_name(j)[end] == ch) ++j;
+		cmdtab_tree_build(child, i, j, end);
+		i = j;
+	}
+}
+
+static void cmdtab_tree_list(const cmdtab_node_t *node, cmdtab_add_t *add, void *ctx)
+{
+	if (node->entry != CMDTAB_NONE)
+	{
+		const char *name = cmdtab_impl_begin[node->entry].name;
+		add(ctx, name, strlen(name), 1);
+	}
+	for (size_t i = 0; i < node->n_children; ++i)
+	{
+		cmdtab_tree_list(&cmdtab_tree.nodes[node->child + i], add, ctx);
+	}
+}
+
+void cmdtab_complete(const char *prefix, size_t len, bool list, cmdtab_add_t *add, void *ctx)
+{
+	const cmdtab_node_t *node = &cmdtab_tree.nodes[0];
+	const char *name;
+	size_t depth = 0;
+
+	if (cmdtab_index.n == 0)
+	{
+		return; // cmdtab_init() failed
+	}
+	if (cmdtab_tree.n_nodes == 0)
+	{
+		for (size_t i = 0; i < cmdtab_index.n; ++i)
+		{
+			cmdtab_build.members[i] = (uint16_t)i;
+		}
+		qsort(cmdtab_build.members, cmdtab_index.n, sizeof(*cmdtab_build.members), &cmdtab_cmp);
+		cmdtab_tree.n_nodes = 1;
+		cmdtab_tree_build(0, 0, cmdtab_index.n, 0);
+	}
+
+	// follow the prefix down to the subtree
+	for (;;)
+	{
+		size_t end = len < node->end ? len : node->end;
+
+		name = cmdtab_impl_begin[node->name].name;
+		if (memcmp(&prefix[depth], &name[depth], end - depth) != 0)
+		{
+			return;
+		}
+		if (len <= node->end)
+		{
+			break;
+		}
+
+		const cmdtab_node_t *child = &cmdtab_tree.nodes[node->child];
+		const cmdtab_node_t *children_end = child + node->n_children;
+		depth = node->end;
+		while (child != children_end && cmdtab_impl_begin[child->name].name[depth] != prefix[depth]) ++child;
+		if (child == children_end)
+		{
+			return;
+		}
+		node = child;
+	}
+
+	if (list)
+	{
+		cmdtab_tree_list(node, add, ctx);
+	}
+	else
+	{
+		add(ctx, name, node->end, node->n_entries);
+	}
+}
+#endif
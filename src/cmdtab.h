@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: BSL-1.0
+
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(CMDTAB_H_INCLUDED)
+#define CMDTAB_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+ * A table of commands gathered by the linker from every translation unit and
+ * indexed by a minimal perfect hash of their names (see cmdtab.c).
+ *
+ * The entries are placed in the "cmdtab" section, whose bounds are provided
+ * by the linker (GNU ld, lld and gold on ELF; ld64 on Mach-O). A custom
+ * linker script has to KEEP(*(cmdtab)) between __start_cmdtab and
+ * __stop_cmdtab. At least one command has to be registered.
+ */
+
+#if !defined(CMDTAB_MAX_SIZE)
+  #define CMDTAB_MAX_SIZE 1024 ///< commands in the table, at most 0x7FFF
+#endif
+
+#if !defined(CMDTAB_ENABLE_COMPLETION)
+  #define CMDTAB_ENABLE_COMPLETION 1 ///< complete the names with a radix tree
+#endif
+
+/// reports n candidates starting with str (n is 1 when str is a candidate)
+typedef void cmdtab_add_t(void *ctx, const char *str, size_t len, size_t n);
+
+typedef struct cmdtab_entry
+{
+	const char *name;
+	int (*func)(int argc, const char **argv);
+	const void *data; ///< nullable, for the application
+	void (*complete)(int index, const char *word, size_t len, cmdtab_add_t *add, void *ctx); ///< nullable, completes the argument index
+} cmdtab_entry_t;
+
+/*
+ * private
+ */
+
+#if defined(__APPLE__)
+  #define CMDTAB_IMPL_SECTION "__DATA,cmdtab"
+#else
+  #define CMDTAB_IMPL_SECTION "cmdtab"
+#endif
+
+/*
+ * public
+ */
+
+/// registers the command name, at file scope (id is any identifier unique in the translation unit)
+#define CMDTAB_REGISTER_COMPLETE(id, name, func, data, complete) \
+	static const cmdtab_entry_t cmdtab_entry_##id \
+	__attribute__((used, section(CMDTAB_IMPL_SECTION), aligned(sizeof(void *)))) = {(name), (func), (data), (complete)}
+
+#define CMDTAB_REGISTER(id, name, func, data) \
+	CMDTAB_REGISTER_COMPLETE(id, name, func, data, NULL)
+
+int cmdtab_init(void); ///< builds the index; -1 if a name is registered twice or there are too many commands
+const cmdtab_entry_t *cmdtab_find(const char *name, size_t len); ///< NULL if the command isn't registered
+size_t cmdtab_size(void);
+const cmdtab_entry_t *cmdtab_at(size_t i); ///< in no particular order
+#if CMDTAB_ENABLE_COMPLETION
+void cmdtab_complete(const char *prefix, size_t len, bool list, cmdtab_add_t *add, void *ctx); ///< reports the names starting with prefix: each one in order if list, else all at once
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // CMDTAB_H_INCLUDED
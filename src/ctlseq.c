@@ -6,8 +6,9 @@
 
 #include "ctlseq.h"
 #include <assert.h>
+#include <string.h>
 
-ctlseq_ev_t ctlseq_sm(ctlseq_st_t *p_st, int c, int *p_psep)
+ctlseq_ev_t ctlseq_sm_ref(ctlseq_st_t *p_st, int c, int *p_psep)
 {
 	ctlseq_ev_t ev = CTLSEQ_EV_NONE;
 	int psep = 0;
@@ -124,3 +125,158 @@ ctlseq_ev_t ctlseq_sm(ctlseq_st_t *p_st, int c, int *p_psep)
 	}
 	return ev;
 }
+
+/*
+ * Table-driven parser
+ */
+
+// byte classes
+enum
+{
+	CTLSEQ_CL_OTHER  = 0,
+	CTLSEQ_CL_ESC    = 1, // CSI 1st byte
+	CTLSEQ_CL_CSI_2  = 2, // CSI 2nd byte, which is also a final byte
+	CTLSEQ_CL_PARAM  = 3,
+	CTLSEQ_CL_PSEP   = 4,
+	CTLSEQ_CL_INTERM = 5,
+	CTLSEQ_CL_FINAL  = 6,
+	CTLSEQ_N_CL      = 7,
+};
+
+#define CTLSEQ_CL_4(cl) cl, cl, cl, cl
+#define CTLSEQ_CL_16(cl) CTLSEQ_CL_4(cl), CTLSEQ_CL_4(cl), CTLSEQ_CL_4(cl), CTLSEQ_CL_4(cl)
+
+static const unsigned char ctlseq_cl_table[256] = {
+	CTLSEQ_CL_16(CTLSEQ_CL_OTHER), // 0x00
+	CTLSEQ_CL_4(CTLSEQ_CL_OTHER), CTLSEQ_CL_4(CTLSEQ_CL_OTHER), // 0x10
+	CTLSEQ_CL_OTHER, CTLSEQ_CL_OTHER, CTLSEQ_CL_OTHER, CTLSEQ_CL_ESC, CTLSEQ_CL_4(CTLSEQ_CL_OTHER),
+	CTLSEQ_CL_16(CTLSEQ_CL_INTERM), // 0x20
+	CTLSEQ_CL_4(CTLSEQ_CL_PARAM), CTLSEQ_CL_4(CTLSEQ_CL_PARAM), // 0x30
+	CTLSEQ_CL_PARAM, CTLSEQ_CL_PARAM, CTLSEQ_CL_PARAM, CTLSEQ_CL_PSEP, CTLSEQ_CL_4(CTLSEQ_CL_PARAM),
+	CTLSEQ_CL_16(CTLSEQ_CL_FINAL), // 0x40
+	CTLSEQ_CL_4(CTLSEQ_CL_FINAL), CTLSEQ_CL_4(CTLSEQ_CL_FINAL), // 0x50
+	CTLSEQ_CL_FINAL, CTLSEQ_CL_FINAL, CTLSEQ_CL_FINAL, CTLSEQ_CL_CSI_2, CTLSEQ_CL_4(CTLSEQ_CL_FINAL),
+	CTLSEQ_CL_16(CTLSEQ_CL_FINAL), // 0x60
+	CTLSEQ_CL_4(CTLSEQ_CL_FINAL), CTLSEQ_CL_4(CTLSEQ_CL_FINAL), CTLSEQ_CL_4(CTLSEQ_CL_FINAL), // 0x70
+	CTLSEQ_CL_FINAL, CTLSEQ_CL_FINAL, CTLSEQ_CL_FINAL, CTLSEQ_CL_OTHER, // DEL
+	// 0x80-0xFF: OTHER
+};
+
+// a transition: the next state, the event and whether a parameter sub-string ends
+#define CTLSEQ_TR(st, ev, psep) ((unsigned char)(CTLSEQ_ST_##st | CTLSEQ_EV_##ev << 3 | (psep) << 6))
+#define CTLSEQ_TR_ST(tr) ((ctlseq_st_t)((tr) & 0x07))
+#define CTLSEQ_TR_EV(tr) ((ctlseq_ev_t)(((tr) >> 3) & 0x07))
+#define CTLSEQ_TR_PSEP(tr) ((tr) >> 6)
+
+#define CTLSEQ_TR_INIT_ROW { \
+	[CTLSEQ_CL_OTHER]  = CTLSEQ_TR(INIT, NONE, 0), \
+	[CTLSEQ_CL_ESC]    = CTLSEQ_TR(ESC, ESC, 0), \
+	[CTLSEQ_CL_CSI_2]  = CTLSEQ_TR(INIT, NONE, 0), \
+	[CTLSEQ_CL_PARAM]  = CTLSEQ_TR(INIT, NONE, 0), \
+	[CTLSEQ_CL_PSEP]   = CTLSEQ_TR(INIT, NONE, 0), \
+	[CTLSEQ_CL_INTERM] = CTLSEQ_TR(INIT, NONE, 0), \
+	[CTLSEQ_CL_FINAL]  = CTLSEQ_TR(INIT, NONE, 0), \
+}
+
+static const unsigned char ctlseq_tr_table[][CTLSEQ_N_CL] = {
+	[CTLSEQ_ST_INIT] = CTLSEQ_TR_INIT_ROW,
+	[CTLSEQ_ST_ESC] = {
+		[CTLSEQ_CL_OTHER]  = CTLSEQ_TR(INIT, ILSEQ, 0),
+		[CTLSEQ_CL_ESC]    = CTLSEQ_TR(INIT, ILSEQ, 0),
+		[CTLSEQ_CL_CSI_2]  = CTLSEQ_TR(CSI, CSI, 0),
+		[CTLSEQ_CL_PARAM]  = CTLSEQ_TR(INIT, ILSEQ, 0),
+		[CTLSEQ_CL_PSEP]   = CTLSEQ_TR(INIT, ILSEQ, 0),
+		[CTLSEQ_CL_INTERM] = CTLSEQ_TR(INIT, ILSEQ, 0),
+		[CTLSEQ_CL_FINAL]  = CTLSEQ_TR(INIT, ILSEQ, 0),
+	},
+	[CTLSEQ_ST_CSI] = {
+		[CTLSEQ_CL_OTHER]  = CTLSEQ_TR(INIT, ILSEQ, 0),
+		[CTLSEQ_CL_ESC]    = CTLSEQ_TR(INIT, ILSEQ, 0),
+		[CTLSEQ_CL_CSI_2]  = CTLSEQ_TR(FINAL, FINAL, 0),
+		[CTLSEQ_CL_PARAM]  = CTLSEQ_TR(PARAM, PARAM, 0),
+		[CTLSEQ_CL_PSEP]   = CTLSEQ_TR(PARAM, PARAM, 1), // an empty parameter sub-string before the first separator
+		[CTLSEQ_CL_INTERM] = CTLSEQ_TR(INTERM, INTERM, 0),
+		[CTLSEQ_CL_FINAL]  = CTLSEQ_TR(FINAL, FINAL, 0),
+	},
+	[CTLSEQ_ST_PARAM] = {
+		// the last parameter sub-string is implicitly terminated
+		[CTLSEQ_CL_OTHER]  = CTLSEQ_TR(INIT, ILSEQ, 1),
+		[CTLSEQ_CL_ESC]    = CTLSEQ_TR(INIT, ILSEQ, 1),
+		[CTLSEQ_CL_CSI_2]  = CTLSEQ_TR(FINAL, FINAL, 1),
+		[CTLSEQ_CL_PARAM]  = CTLSEQ_TR(PARAM, NONE, 0),
+		[CTLSEQ_CL_PSEP]   = CTLSEQ_TR(PARAM, NONE, 1),
+		[CTLSEQ_CL_INTERM] = CTLSEQ_TR(INTERM, INTERM, 1),
+		[CTLSEQ_CL_FINAL]  = CTLSEQ_TR(FINAL, FINAL, 1),
+	},
+	[CTLSEQ_ST_INTERM] = {
+		[CTLSEQ_CL_OTHER]  = CTLSEQ_TR(INIT, ILSEQ, 0),
+		[CTLSEQ_CL_ESC]    = CTLSEQ_TR(INIT, ILSEQ, 0),
+		[CTLSEQ_CL_CSI_2]  = CTLSEQ_TR(FINAL, FINAL, 0),
+		[CTLSEQ_CL_PARAM]  = CTLSEQ_TR(INIT, ILSEQ, 0),
+		[CTLSEQ_CL_PSEP]   = CTLSEQ_TR(INIT, ILSEQ, 0),
+		[CTLSEQ_CL_INTERM] = CTLSEQ_TR(INTERM, NONE, 0),
+		[CTLSEQ_CL_FINAL]  = CTLSEQ_TR(FINAL, FINAL, 0),
+	},
+	[CTLSEQ_ST_FINAL] = CTLSEQ_TR_INIT_ROW, // reset
+};
+
+static inline
+unsigned ctlseq_cl(int c)
+{
+	return (0x00 <= c && c <= 0xFF) ? ctlseq_cl_table[c] : CTLSEQ_CL_OTHER;
+}
+
+ctlseq_ev_t ctlseq_sm(ctlseq_st_t *p_st, int c, int *p_psep)
+{
+	assert(p_st != NULL);
+
+	unsigned tr = ctlseq_tr_table[*p_st][ctlseq_cl(c)];
+	*p_st = CTLSEQ_TR_ST(tr);
+
+	if (p_psep != NULL)
+	{
+		*p_psep = (int)CTLSEQ_TR_PSEP(tr);
+	}
+	return CTLSEQ_TR_EV(tr);
+}
+
+size_t ctlseq_sm_n(ctlseq_st_t *p_st, const char *buf, size_t n, ctlseq_event_t *events, size_t max_events)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	ctlseq_st_t st;
+	size_t n_events = 0;
+
+	assert(p_st != NULL);
+	assert(buf != NULL || n == 0);
+	assert(events != NULL || max_events == 0);
+
+	st = *p_st;
+	for (size_t i = 0; i < n && n_events < max_events; ++i)
+	{
+		if ((st == CTLSEQ_ST_INIT || st == CTLSEQ_ST_FINAL) && p[i] != CTLSEQ_C_CSI_1)
+		{
+			// plain text up to the next ESC raises no event
+			const unsigned char *esc = memchr(&p[i], CTLSEQ_C_CSI_1, n - i);
+			if (esc == NULL)
+			{
+				st = CTLSEQ_ST_INIT;
+				break;
+			}
+			st = CTLSEQ_ST_INIT;
+			i = (size_t)(esc - p);
+		}
+
+		unsigned tr = ctlseq_tr_table[st][ctlseq_cl_table[p[i]]];
+		st = CTLSEQ_TR_ST(tr);
+
+		// every byte of a control sequence, the ones ending it included
+		events[n_events].pos = i;
+		events[n_events].ev = CTLSEQ_TR_EV(tr);
+		events[n_events].st = st;
+		events[n_events].psep = (int)CTLSEQ_TR_PSEP(tr);
+		++n_events;
+	}
+	*p_st = st;
+
+	return n_events;
+}
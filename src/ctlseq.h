@@ -385,7 +385,21 @@ typedef enum ctlseq_ev
 	CTLSEQ_EV_ILSEQ    = 6, // illegal sequence
 } ctlseq_ev_t;
 
+typedef struct ctlseq_event
+{
+	size_t pos; // of the byte
+	ctlseq_ev_t ev; // CTLSEQ_EV_NONE for a parameter or intermediate byte which continues the sequence
+	ctlseq_st_t st; // state after the byte
+	int psep; // whether a parameter sub-string ends at the byte
+} ctlseq_event_t;
+
 ctlseq_ev_t ctlseq_sm(ctlseq_st_t *p_st, int c, int *p_psep); // state machine (p_psep is nullable)
+ctlseq_ev_t ctlseq_sm_ref(ctlseq_st_t *p_st, int c, int *p_psep); // same as ctlseq_sm(), written out as a switch (reference for differential tests)
+
+// runs the state machine over buf and stores an event for each byte of a control sequence, parameter bytes included;
+// the bytes between the events are plain text, which is skipped up to the next ESC in bulk and leaves the state at CTLSEQ_ST_INIT;
+// returns the number of events stored, stops after the byte whose event fills events, otherwise consumes all n bytes
+size_t ctlseq_sm_n(ctlseq_st_t *p_st, const char *buf, size_t n, ctlseq_event_t *events, size_t max_events);
 
 #if defined(__cplusplus)
 }
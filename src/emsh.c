@@ -8,6 +8,7 @@
 
 #include "ascii.h"
 #include "ctlseq.h"
+#include "gapbuf.h"
 #include "numcast10.h"
 #include <assert.h>
 #include <stddef.h>
@@ -15,6 +16,10 @@
 #include <string.h>
 #include <limits.h>
 
+#if EMSH_MAX_CSI_PARAMS < 2
+  #error "EMSH_MAX_CSI_PARAMS has to be at least 2"
+#endif
+
 /*
  * Buffer
  */
@@ -22,29 +27,59 @@
 /// capacity doesn't include terminator (NUL byte)
 static void emsh_buf_init(emsh_buf_t *self, char *data, size_t capacity)
 {
-	bytearray_init(&self->array, capacity, (bytearray_datum_t *)data);
-	bytearray_resize(&self->array, strlen(data));
-	self->pos = bytearray_size(&self->array);
+	gapbuf_init(&self->gap, capacity, (gapbuf_datum_t *)data);
+	gapbuf_resize(&self->gap, strlen(data));
+	self->pos = gapbuf_size(&self->gap);
 }
 
 static size_t emsh_buf_capacity(const emsh_buf_t *self)
 {
-	return bytearray_capacity(&self->array);
+	return gapbuf_capacity(&self->gap);
 }
 
 static size_t emsh_buf_size(const emsh_buf_t *self)
 {
-	return bytearray_size(&self->array);
+	return gapbuf_size(&self->gap);
 }
 
-static const char *emsh_buf_data_const(const emsh_buf_t *self)
+/// closes the gap and terminates the line; O(size) only when the gap has to move
+static char *emsh_buf_data(emsh_buf_t *self)
 {
-	return (const char *)bytearray_data_const(&self->array);
+	char *data = (char *)gapbuf_compact(&self->gap);
+	data[emsh_buf_size(self)] = '\0';
+	return data;
 }
 
-static char *emsh_buf_data(emsh_buf_t *self)
+/// describes [begin, end) of the line, which may be split by the gap, as up to two entries
+static size_t emsh_buf_iov(const emsh_buf_t *self, size_t begin, size_t end, emsh_iov_t iov[2])
+{
+	size_t n_front, n_back;
+	const char *front = (const char *)gapbuf_front(&self->gap, &n_front);
+	const char *back = (const char *)gapbuf_back(&self->gap, &n_back);
+	size_t n = 0;
+
+	assert(begin <= end && end <= emsh_buf_size(self));
+
+	if (begin < n_front)
+	{
+		iov[n].base = front + begin;
+		iov[n].len = (end < n_front ? end : n_front) - begin;
+		++n;
+	}
+	if (end > n_front)
+	{
+		size_t back_begin = begin > n_front ? begin - n_front : 0;
+		iov[n].base = back + back_begin;
+		iov[n].len = end - n_front - back_begin;
+		++n;
+	}
+
+	return n;
+}
+
+static char emsh_buf_at(const emsh_buf_t *self, size_t i)
 {
-	return (char *)bytearray_data(&self->array);
+	return (char)gapbuf_at(&self->gap, i);
 }
 
 static size_t emsh_buf_pos(const emsh_buf_t *self)
@@ -79,432 +114,2299 @@ static void emsh_buf_insert(emsh_buf_t *self, char ch)
 {
 	assert(emsh_buf_size(self) != emsh_buf_capacity(self));
 
-	bytearray_insert(&self->array, self->pos, ch);
-	emsh_buf_data(self)[emsh_buf_size(self)] = '\0';
+	gapbuf_insert(&self->gap, self->pos, (gapbuf_datum_t)ch);
 	++self->pos;
 }
 
+static void emsh_buf_insert_n(emsh_buf_t *self, const char *str, size_t n)
+{
+	assert(emsh_buf_size(self) + n <= emsh_buf_capacity(self));
+
+	gapbuf_insert_n(&self->gap, self->pos, (const gapbuf_datum_t *)str, n);
+	self->pos += n;
+}
+
 static void emsh_buf_erase(emsh_buf_t *self)
 {
 	assert(self->pos != emsh_buf_size(self));
 
-	bytearray_erase(&self->array, self->pos);
-	emsh_buf_data(self)[emsh_buf_size(self)] = '\0';
+	gapbuf_erase(&self->gap, self->pos);
 }
 
 /*
  * History
+ *
+ * |<--                       mem_size                       -->|
+ * |ent|ent|ent|**********|ent|ent|ent|ent|ent|ent|.............|
+ *              ^          ^                    ^
+ *            tail       head                wrap_end
+ *
+ *  ent := len (2 bytes) | characters
+ *  * := free
+ *
+ * Entries are packed back to back in a circular arena. An entry which doesn't
+ * fit before the end of the arena starts over at offset 0 and the oldest
+ * entries are evicted until it fits.
+ *
+ * A ring of offsets indexes the live entries from the oldest to the newest, so
+ * that the entry of any age is found in O(1). An entry dropped from the ring
+ * stays in the arena as garbage until it gets evicted.
+ *
+ * For the search, each slot of the ring also keeps a 64-bit signature with a
+ * bit set for every trigram of its entry. An entry is compared with a query
+ * only when its signature has all the bits of the query's.
+ *
+ * With EMSH_ENABLE_SEARCH_INDEX, the search looks up a trigram index instead.
+ * The trigrams are hashed to buckets, each keeping the offset of its newest
+ * occurrence in the arena and the number of its occurrences; chain[off] links
+ * the occurrence at off to the previous one of its bucket, as in the hash
+ * chains of LZ77 compressors. A query walks the chain of its trigram with the
+ * fewest occurrences, newest first, and compares itself at each of them. The
+ * occurrences in an evicted entry leave their buckets as it's evicted; the
+ * rest of a chain past one of them is older, so the walk stops at the first
+ * offset which is out of the arena or not older than the one before it.
+ *
+ * For the prefix search, the offsets of the live entries are also kept sorted
+ * by their characters (then by their age), so that the entries starting with
+ * a prefix are found by binary search as a contiguous range.
  */
 
-static void emsh_hist_init(emsh_hist_t *self, emsh_block_t *blocks, size_t n_blocks)
+static size_t emsh_hist_get_len(const emsh_hist_t *self, size_t off)
 {
-	assert(n_blocks != 0);
-
-	self->capacity = n_blocks;
-	list_init(&self->free_list);
-	for (size_t i = 0; i < n_blocks; ++i)
-	{
-		list_node_init(&blocks[i].node);
-		blocks[i].mem[0] = '\0';
-		list_push_back(&self->free_list, &blocks[i].node);
-	}
+	return (size_t)self->mem[off] | (size_t)self->mem[off + 1] << 8;
+}
 
-	list_init(&self->list);
-	list_push_front(&self->list, list_pop_front(&self->free_list));
-	self->size = 1;
+static void emsh_hist_set_len(emsh_hist_t *self, size_t off, size_t len)
+{
+	self->mem[off + 0] = (unsigned char)(len & 0xFF);
+	self->mem[off + 1] = (unsigned char)(len >> 8);
+}
 
-	self->pos = 0;
-	self->cur = list_front(&self->list);
+static size_t emsh_hist_capacity(const emsh_hist_t *self)
+{
+#if EMSH_ENABLE_RUNTIME_SIZE
+	return self->capacity;
+#else
+	(void)self;
+	return EMSH_MAX_HIST_SIZE;
+#endif
 }
 
-static char *emsh_hist_current(emsh_hist_t *self)
+/// ring index of the entry of age (1 is the newest)
+static size_t emsh_hist_ring_index(const emsh_hist_t *self, size_t age)
 {
-	return list_entry_of(self->cur, emsh_block_t, node)->mem;
+	assert(age != 0 && age <= self->size);
+
+	return (self->first + self->size - age) % emsh_hist_capacity(self);
 }
 
-static void emsh_hist_commit(emsh_hist_t *self)
+#if EMSH_ENABLE_SEARCH && !EMSH_ENABLE_SEARCH_INDEX
+static uint64_t emsh_hist_sig(const char *str, size_t len)
 {
-	if (self->pos != 0)
-	{
-		// remove the draft
-		list_push_back(&self->free_list, list_pop_front(&self->list));
-		--self->size;
+	uint64_t sig = 0;
 
-		// bring the current entry to the front
-		list_node_unlink(self->cur);
-		list_push_front(&self->list, self->cur);
-	}
-	else if (self->size == self->capacity)
+	for (size_t i = 0; i + 3 <= len; ++i)
 	{
-		// retire the oldest entry
-		list_push_back(&self->free_list, list_pop_back(&self->list));
-		--self->size;
+		uint_fast32_t tri = (uint_fast32_t)(unsigned char)str[i] << 16 |
+		                    (uint_fast32_t)(unsigned char)str[i + 1] << 8 |
+		                    (uint_fast32_t)(unsigned char)str[i + 2];
+		sig |= (uint64_t)1 << ((uint32_t)(tri * 2654435761u) >> 26);
 	}
 
-	// add a new draft
-	list_push_front(&self->list, list_pop_front(&self->free_list));
-	++self->size;
+	return sig;
+}
+#endif
 
-	// move focus to the new draft
-	self->pos = 0;
-	self->cur = list_front(&self->list);
-	emsh_hist_current(self)[0] = '\0';
+#if EMSH_ENABLE_PREFIX_SEARCH || EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE || EMSH_ENABLE_SEARCH_INDEX
+/// position of the entry at off in the order of commits
+static size_t emsh_hist_lin(const emsh_hist_t *self, size_t off)
+{
+	return (off >= self->head) ? off - self->head : off + (self->wrap_end - self->head);
 }
 
-static void emsh_hist_move_backward(emsh_hist_t *self)
+/// the age of the newest live entry starting at or before off in the order of commits, 0 if there's none
+static size_t emsh_hist_age_at(const emsh_hist_t *self, size_t off)
 {
-	if (self->pos < self->size - 1)
+	size_t lin = emsh_hist_lin(self, off);
+	size_t lo = 1;
+	size_t hi = self->size;
+
+	// the older, the smaller lin
+	while (lo < hi)
 	{
-		++self->pos;
-		self->cur = list_node_next(self->cur);
+		size_t mid = lo + (hi - lo) / 2;
+		if (emsh_hist_lin(self, self->ring[emsh_hist_ring_index(self, mid)].off) > lin)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
 	}
-}
 
-static void emsh_hist_move_forward(emsh_hist_t *self)
-{
-	if (self->pos > 0)
+	if (lo > self->size || emsh_hist_lin(self, self->ring[emsh_hist_ring_index(self, lo)].off) > lin)
 	{
-		--self->pos;
-		self->cur = list_node_prev(self->cur);
+		return 0;
 	}
+	return lo;
 }
+#endif
 
-/*
- * Write
- */
-
-static void emsh_write_char(emsh_t *self, char ch)
+#if EMSH_ENABLE_PREFIX_SEARCH || EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+/// the age of the live entry at off
+static size_t emsh_hist_age_of(const emsh_hist_t *self, size_t off)
 {
-	self->ops.write_char(self->cookie, ch);
-}
+	size_t age = emsh_hist_age_at(self, off);
 
-static void emsh_write_strn(emsh_t *self, const char *str, size_t len)
-{
-	self->ops.write_strn(self->cookie, str, len);
+	assert(age != 0 && self->ring[emsh_hist_ring_index(self, age)].off == off);
+	return age;
 }
+#endif
 
-// str should be a compile-time constant
-#define emsh_write_str(self, str) emsh_write_strn(self, str, strlen(str))
-
-static void emsh_write_prompt(emsh_t *self)
+#if EMSH_ENABLE_SEARCH_INDEX
+/// whether off is within the entries of the arena, live or not
+static bool emsh_hist_in_arena(const emsh_hist_t *self, size_t off)
 {
-	emsh_write_str(self, EMSH_S_PROMPT);
+	if (self->wrapped)
+	{
+		return (off >= self->head) ? off < self->wrap_end : off < self->tail;
+	}
+	return off >= self->head && off < self->tail;
 }
 
-static void emsh_write_cr(emsh_t *self)
+/// the bucket of the trigram at str
+static emsh_hist_trigram_t *emsh_hist_trigram(emsh_hist_t *self, const unsigned char *str)
 {
-	emsh_write_char(self, ASCII_C_CR);
-}
+	uint_fast32_t tri = (uint_fast32_t)str[0] << 16 | (uint_fast32_t)str[1] << 8 | (uint_fast32_t)str[2];
 
-static void emsh_write_newline(emsh_t *self)
-{
-	emsh_write_str(self, EMSH_S_NEWLINE);
+	return &self->trigrams[((uint32_t)(tri * 2654435761u) >> 16) & (EMSH_SEARCH_INDEX_SIZE - 1)];
 }
 
-static void emsh_write_ctlseq_1(emsh_t *self, uint_fast32_t param_val, char interm_byte, char final_byte)
+/// chains the trigrams of the newest entry at off
+static void emsh_hist_trigrams_insert(emsh_hist_t *self, size_t off)
 {
-	char buf[2+NUMCAST10_SIZE_OF(uint_fast32_t)+1+1]; // CSI P ... P (I) F
-	size_t len = 0;
-
-	// CSI
-	buf[len + 0] = CTLSEQ_C_CSI_1;
-	buf[len + 1] = CTLSEQ_C_CSI_2;
-	len += 2;
-
-	// P ... P
-	len += numcast10_from_uint_fast32_t(&buf[len], param_val);
+	size_t end = off + EMSH_HIST_ENTRY_SIZE(emsh_hist_get_len(self, off));
 
-	// (I)
-	if (interm_byte != 0x00)
+	for (size_t i = off + 2; i + 3 <= end; ++i)
 	{
-		buf[len] = interm_byte;
-		++len;
+		emsh_hist_trigram_t *t = emsh_hist_trigram(self, &self->mem[i]);
+		self->chain[i] = t->newest;
+		t->newest = i;
+		++t->count;
 	}
-
-	// F
-	buf[len] = final_byte;
-	++len;
-
-	emsh_write_strn(self, buf, len);
 }
 
-static void emsh_write_ctlseq_el(emsh_t *self, int param)
+/// unchains the trigrams of the oldest entry of the arena at off as it's evicted
+static void emsh_hist_trigrams_erase(emsh_hist_t *self, size_t off)
 {
-	switch (param)
+	size_t end = off + EMSH_HIST_ENTRY_SIZE(emsh_hist_get_len(self, off));
+
+	for (size_t i = off + 2; i + 3 <= end; ++i)
 	{
-	case 0:
-		emsh_write_str(self, CTLSEQ_S_CSI CTLSEQ_S_EL);
-		break;
-	case 1:
-		emsh_write_str(self, CTLSEQ_S_CSI "1" CTLSEQ_S_EL);
-		break;
-	case 2:
-		emsh_write_str(self, CTLSEQ_S_CSI "2" CTLSEQ_S_EL);
-		break;
-	default:
-		assert(0);
-		break;
+		emsh_hist_trigram_t *t = emsh_hist_trigram(self, &self->mem[i]);
+		--t->count;
+		if (t->newest == i)
+		{
+			t->newest = SIZE_MAX; // the rest of its chain is older
+		}
 	}
 }
+#endif
+
+#if EMSH_ENABLE_PREFIX_SEARCH
+/// compares the characters of the entry at off with str
+static int emsh_hist_cmp(const emsh_hist_t *self, size_t off, const char *str, size_t len)
+{
+	size_t ent_len = emsh_hist_get_len(self, off);
+	int r = memcmp(&self->mem[off + 2], str, (ent_len < len) ? ent_len : len);
+
+	return (r != 0) ? r : (ent_len > len) - (ent_len < len);
+}
 
-static void emsh_write_ctlseq_cuf(emsh_t *self, uint_fast32_t n)
+static bool emsh_hist_has_prefix(const emsh_hist_t *self, size_t off, const char *prefix, size_t len)
 {
-	if (n == 0)
-	{
-		// nothing to do
-	}
-	else if (n == 1)
-	{
-		emsh_write_str(self, CTLSEQ_S_CSI CTLSEQ_S_CUF);
-	}
-	else
-	{
-		emsh_write_ctlseq_1(self, n, 0x00, CTLSEQ_C_CUF);
-	}
+	return emsh_hist_get_len(self, off) >= len && memcmp(&self->mem[off + 2], prefix, len) == 0;
 }
 
-static void emsh_write_ctlseq_cub(emsh_t *self, uint_fast32_t n)
+/// index of the first sorted entry which is not before str committed at lin
+static size_t emsh_hist_lower_bound(const emsh_hist_t *self, const char *str, size_t len, size_t lin)
 {
-	if (n == 0)
-	{
-		// nothing to do
-	}
-	else if (n == 1)
-	{
-		emsh_write_str(self, CTLSEQ_S_CSI CTLSEQ_S_CUB);
-	}
-	else
+	size_t lo = 0;
+	size_t hi = self->size;
+
+	while (lo < hi)
 	{
-		emsh_write_ctlseq_1(self, n, 0x00, CTLSEQ_C_CUB);
+		size_t mid = lo + (hi - lo) / 2;
+		size_t off = self->sorted[mid];
+		int r = emsh_hist_cmp(self, off, str, len);
+		if (r < 0 || (r == 0 && emsh_hist_lin(self, off) < lin))
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
 	}
-}
 
-/*
- * Display
- */
+	return lo;
+}
 
-static void emsh_disp_refresh_cur_to_eol(emsh_t *self)
+/// adds the entry at off, which has to be the newest one, before it's counted in size
+static void emsh_hist_sorted_insert(emsh_hist_t *self, size_t off)
 {
-	size_t size = emsh_buf_size(&self->buf);
-	size_t pos = emsh_buf_pos(&self->buf);
+	size_t i = emsh_hist_lower_bound(self, (const char *)&self->mem[off + 2], emsh_hist_get_len(self, off), SIZE_MAX);
 
-	emsh_write_ctlseq_el(self, 0);
-	emsh_write_strn(self, emsh_buf_data_const(&self->buf) + pos, size - pos);
-	emsh_write_ctlseq_cub(self, (uint_fast32_t)(size - pos));
+	memmove(&self->sorted[i + 1], &self->sorted[i], (self->size - i) * sizeof(*self->sorted));
+	self->sorted[i] = off;
 }
 
-static void emsh_disp_refresh_line(emsh_t *self)
+/// removes the entry at off, before it's uncounted from size
+static void emsh_hist_sorted_erase(emsh_hist_t *self, size_t off)
 {
-	emsh_buf_init(&self->buf, emsh_hist_current(&self->hist), EMSH_MAX_LINE_SIZE);
+	size_t i = emsh_hist_lower_bound(self, (const char *)&self->mem[off + 2], emsh_hist_get_len(self, off),
+	                                 emsh_hist_lin(self, off));
 
-	emsh_write_cr(self);
-	emsh_write_ctlseq_el(self, 0);
-	emsh_write_prompt(self);
-	emsh_write_strn(self, emsh_buf_data_const(&self->buf), emsh_buf_size(&self->buf));
+	assert(i < self->size && self->sorted[i] == off);
+
+	memmove(&self->sorted[i], &self->sorted[i + 1], (self->size - i - 1) * sizeof(*self->sorted));
 }
 
-/*
- * Cursor
- */
+#endif
 
-static void emsh_cur_move_forward(emsh_t *self)
+#if EMSH_HIST_DEDUP != EMSH_HIST_DEDUP_NONE
+static bool emsh_hist_equals(const emsh_hist_t *self, size_t off, const char *str, size_t len)
 {
-	assert(emsh_buf_pos(&self->buf) < emsh_buf_size(&self->buf));
+	return emsh_hist_get_len(self, off) == len && memcmp(&self->mem[off + 2], str, len) == 0;
+}
+#endif
 
-	emsh_buf_inc_pos(&self->buf);
-	emsh_write_ctlseq_cuf(self, 1);
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+static size_t emsh_hist_hash_size(const emsh_hist_t *self)
+{
+	return EMSH_HIST_HASH_SIZE(emsh_hist_capacity(self));
 }
 
-static void emsh_cur_move_backward(emsh_t *self)
+/// the home bucket of str (FNV-1a)
+static size_t emsh_hist_hash_of(const emsh_hist_t *self, const char *str, size_t len)
 {
-	assert(emsh_buf_pos(&self->buf) > 0);
+	uint_fast32_t h = 2166136261u;
 
-	emsh_buf_dec_pos(&self->buf);
-	emsh_write_ctlseq_cub(self, 1);
+	for (size_t i = 0; i < len; ++i)
+	{
+		h = ((h ^ (unsigned char)str[i]) * 16777619u) & 0xFFFFFFFFu;
+	}
+
+	return h % emsh_hist_hash_size(self);
 }
 
-static void emsh_cur_set_pos(emsh_t *self, size_t pos)
+/// the bucket holding the entry equal to str, or the empty one ending its probe sequence
+static size_t emsh_hist_hash_find(const emsh_hist_t *self, const char *str, size_t len)
 {
-	assert(pos <= emsh_buf_size(&self->buf));
+	size_t i = emsh_hist_hash_of(self, str, len);
 
-	emsh_write_cr(self);
-	emsh_write_ctlseq_cuf(self, (uint_fast32_t)(strlen(EMSH_S_PROMPT) + pos));
-	emsh_buf_set_pos(&self->buf, pos);
+	while (self->hash[i] != 0 && !emsh_hist_equals(self, self->hash[i] - 1, str, len))
+	{
+		i = (i + 1) % emsh_hist_hash_size(self);
+	}
+
+	return i;
 }
 
-/*
- * Command processor
- */
+static void emsh_hist_hash_insert(emsh_hist_t *self, size_t off)
+{
+	size_t i = emsh_hist_hash_find(self, (const char *)&self->mem[off + 2], emsh_hist_get_len(self, off));
+
+	assert(self->hash[i] == 0); // entries are unique
 
-/// updates cmd.argc and cmd.argv
-static void emsh_cmd_split(emsh_t *self)
+	self->hash[i] = off + 1;
+}
+
+/// removes the entry at off, shifting back the following entries of the cluster (no tombstones)
+static void emsh_hist_hash_erase(emsh_hist_t *self, size_t off)
 {
-	size_t pos = 0;
-	size_t size = emsh_buf_size(&self->buf);
-	char *data = emsh_buf_data(&self->buf);
+	size_t n = emsh_hist_hash_size(self);
+	size_t i = emsh_hist_hash_find(self, (const char *)&self->mem[off + 2], emsh_hist_get_len(self, off));
 
-	self->cmd.argc = 0;
+	assert(self->hash[i] == off + 1);
 
-	// skip leading spaces
-	while (pos < size && data[pos] == ' ') ++pos;
-	if (pos == size)
+	for (size_t j = (i + 1) % n; self->hash[j] != 0; j = (j + 1) % n)
 	{
-		return;
-	}
+		size_t ent = self->hash[j] - 1;
+		size_t home = emsh_hist_hash_of(self, (const char *)&self->mem[ent + 2], emsh_hist_get_len(self, ent));
 
-	// split arguments
-	while (pos < size)
-	{
-		if (self->cmd.argc == EMSH_MAX_N_ARGS)
+		// move it into the hole unless its home lies cyclically in (i, j]
+		if ((j > i) ? (home <= i || home > j) : (home <= i && home > j))
 		{
-			++self->cmd.argc;
-			break;
+			self->hash[i] = self->hash[j];
+			i = j;
 		}
-
-		self->cmd.argv[self->cmd.argc] = &data[pos];
-		while (pos < size && data[pos] != ' ') ++pos;
-		data[pos] = '\0';
-		++pos;
-		while (pos < size && data[pos] == ' ') ++pos;
-
-		++self->cmd.argc;
 	}
+	self->hash[i] = 0;
 }
+#endif
 
-static void emsh_cmd_exec(emsh_t *self)
+/// adds the newest entry to the indexes, before it's counted in size
+static void emsh_hist_index_insert(emsh_hist_t *self, size_t off)
 {
-#if EMSH_ENABLE_GETOPT
-	self->cmd.optpos = 1;
-	emsh_optind = 1;
+#if EMSH_ENABLE_PREFIX_SEARCH
+	emsh_hist_sorted_insert(self, off);
+#endif
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+	emsh_hist_hash_insert(self, off);
 #endif
-	self->ops.exec(self->cookie, self->cmd.argc, self->cmd.argv);
+	(void)self;
+	(void)off;
 }
 
-static void emsh_cmd_restore(emsh_t *self)
+/// removes an entry from the indexes, before it's uncounted from size
+static void emsh_hist_index_erase(emsh_hist_t *self, size_t off)
 {
-	size_t size = emsh_buf_size(&self->buf);
-	char *data = emsh_buf_data(&self->buf);
-
-	for (size_t i = 0; i < size; ++i)
-	{
-		if (data[i] == '\0')
-		{
-			data[i] = ' ';
-		}
-	}
+#if EMSH_ENABLE_PREFIX_SEARCH
+	emsh_hist_sorted_erase(self, off);
+#endif
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+	emsh_hist_hash_erase(self, off);
+#endif
+	(void)self;
+	(void)off;
 }
 
-static bool emsh_cmd_run(emsh_t *self)
+static void emsh_hist_init(emsh_hist_t *self, char *mem, size_t mem_size)
 {
-	emsh_cmd_split(self);
-	if (self->cmd.argc == 0)
-	{
-		// ignore
-	}
-	else if (self->cmd.argc <= EMSH_MAX_N_ARGS)
-	{
-		emsh_cmd_exec(self);
-	}
-	else
+	assert(mem != NULL);
+
+	self->mem = (unsigned char *)mem;
+	self->mem_size = mem_size;
+	self->head = 0;
+	self->tail = 0;
+	self->wrap_end = 0;
+	self->wrapped = false;
+	self->first = 0;
+	self->size = 0;
+	self->pos = 0;
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+	memset(self->hash, 0, emsh_hist_hash_size(self) * sizeof(*self->hash));
+#endif
+#if EMSH_ENABLE_SEARCH_INDEX
+	for (size_t i = 0; i < EMSH_SEARCH_INDEX_SIZE; ++i)
 	{
-		emsh_write_str(self, "emsh: Argument list too long." EMSH_S_NEWLINE);
+		self->trigrams[i].newest = SIZE_MAX;
+		self->trigrams[i].count = 0;
 	}
-	emsh_cmd_restore(self);
+#endif
+}
 
-	return self->cmd.argc != 0;
+static bool emsh_hist_arena_empty(const emsh_hist_t *self)
+{
+	return !self->wrapped && self->head == self->tail;
 }
 
-/*
- * Actions
- */
+/// drops the oldest entry from the ring
+static void emsh_hist_pop_oldest(emsh_hist_t *self)
+{
+	assert(self->size != 0);
 
-static void emsh_do_commit(emsh_t *self)
+	emsh_hist_index_erase(self, self->ring[self->first].off);
+	self->first = (self->first + 1) % emsh_hist_capacity(self);
+	--self->size;
+}
+
+static void emsh_hist_evict(emsh_hist_t *self)
 {
-	emsh_write_newline(self);
+	assert(!emsh_hist_arena_empty(self));
 
-	if (emsh_cmd_run(self))
+	if (self->size != 0 && self->ring[self->first].off == self->head)
 	{
-		emsh_hist_commit(&self->hist);
-		emsh_buf_init(&self->buf, emsh_hist_current(&self->hist), EMSH_MAX_LINE_SIZE);
+		emsh_hist_pop_oldest(self);
 	}
-
-	if (self->running)
+#if EMSH_ENABLE_SEARCH_INDEX
+	emsh_hist_trigrams_erase(self, self->head);
+#endif
+	self->head += EMSH_HIST_ENTRY_SIZE(emsh_hist_get_len(self, self->head));
+	if (self->wrapped && self->head == self->wrap_end)
 	{
-		emsh_write_prompt(self);
+		self->head = 0;
+		self->wrapped = false;
 	}
 }
 
-static void emsh_do_insert(emsh_t *self, int c)
+/// makes n contiguous bytes free at tail
+static void emsh_hist_reserve(emsh_hist_t *self, size_t n)
 {
-	if (emsh_buf_size(&self->buf) < emsh_buf_capacity(&self->buf))
+	assert(n <= self->mem_size);
+
+	for (;;)
 	{
-		emsh_buf_insert(&self->buf, c);
-		emsh_write_char(self, (char)c);
-		emsh_disp_refresh_cur_to_eol(self);
+		if (!self->wrapped)
+		{
+			if (emsh_hist_arena_empty(self))
+			{
+				self->head = 0;
+				self->tail = 0;
+			}
+			if (self->mem_size - self->tail >= n)
+			{
+				return;
+			}
+			self->wrap_end = self->tail;
+			self->tail = 0;
+			self->wrapped = true;
+		}
+		else if (self->head - self->tail >= n)
+		{
+			return;
+		}
+		else
+		{
+			emsh_hist_evict(self);
+		}
 	}
 }
 
-static void emsh_do_erase(emsh_t *self)
+/// the characters of the entry of age (not terminated), or NULL if there's no such entry
+static const char *emsh_hist_at(const emsh_hist_t *self, size_t age, size_t *p_len)
 {
-	if (emsh_buf_pos(&self->buf) != emsh_buf_size(&self->buf))
+	if (age == 0 || age > self->size)
 	{
-		emsh_buf_erase(&self->buf);
-		emsh_disp_refresh_cur_to_eol(self);
+		*p_len = 0;
+		return NULL;
 	}
-}
 
-/// cursor up
-static void emsh_do_cuu(emsh_t *self)
-{
-	emsh_hist_move_backward(&self->hist);
-	emsh_disp_refresh_line(self);
+	size_t off = self->ring[emsh_hist_ring_index(self, age)].off;
+	*p_len = emsh_hist_get_len(self, off);
+	return (const char *)&self->mem[off + 2];
 }
 
-/// cursor down
-static void emsh_do_cud(emsh_t *self)
+/// the entry at pos, which must not be 0
+static const char *emsh_hist_current(const emsh_hist_t *self, size_t *p_len)
 {
-	emsh_hist_move_forward(&self->hist);
-	emsh_disp_refresh_line(self);
+	assert(self->pos != 0);
+
+	return emsh_hist_at(self, self->pos, p_len);
 }
 
-/// cursor forward
-static void emsh_do_cuf(emsh_t *self)
+/// removes the entry of age from the ring, closing its slot
+static void emsh_hist_remove(emsh_hist_t *self, size_t age)
 {
-	if (emsh_buf_pos(&self->buf) < emsh_buf_size(&self->buf))
+	emsh_hist_index_erase(self, self->ring[emsh_hist_ring_index(self, age)].off);
+	for (; age > 1; --age)
 	{
-		emsh_cur_move_forward(self);
+		self->ring[emsh_hist_ring_index(self, age)] = self->ring[emsh_hist_ring_index(self, age - 1)];
 	}
+	--self->size;
 }
 
-/// cursor back
-static void emsh_do_cub(emsh_t *self)
+/// appends line as the newest entry; a recalled entry which has been committed gets removed;
+/// returns false if the dedup policy left line out
+static bool emsh_hist_commit(emsh_hist_t *self, const char *line, size_t len)
 {
-	if (emsh_buf_pos(&self->buf) > 0)
+	size_t cap = emsh_hist_capacity(self);
+
+	assert(len <= 0xFFFF);
+
+	if (self->pos != 0)
 	{
-		emsh_cur_move_backward(self);
+		emsh_hist_remove(self, self->pos);
 	}
-}
-
-/// backspace
-static void emsh_do_bs(emsh_t *self)
+	self->pos = 0;
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_CONSECUTIVE
+	if (self->size != 0 && emsh_hist_equals(self, self->ring[emsh_hist_ring_index(self, 1)].off, line, len))
+	{
+		return false;
+	}
+#elif EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+	size_t i = emsh_hist_hash_find(self, line, len);
+	if (self->hash[i] != 0)
+	{
+		emsh_hist_remove(self, emsh_hist_age_of(self, self->hash[i] - 1));
+	}
+#endif
+	emsh_hist_reserve(self, EMSH_HIST_ENTRY_SIZE(len));
+	if (self->size == cap)
+	{
+		emsh_hist_pop_oldest(self);
+	}
+
+	emsh_hist_set_len(self, self->tail, len);
+	memcpy(&self->mem[self->tail + 2], line, len);
+	emsh_hist_slot_t *slot = &self->ring[(self->first + self->size) % cap];
+	slot->off = self->tail;
+#if EMSH_ENABLE_SEARCH_INDEX
+	emsh_hist_trigrams_insert(self, self->tail);
+#elif EMSH_ENABLE_SEARCH
+	slot->sig = emsh_hist_sig(line, len);
+#endif
+	emsh_hist_index_insert(self, self->tail);
+	++self->size;
+	self->tail += EMSH_HIST_ENTRY_SIZE(len);
+	return true;
+}
+
+#if EMSH_ENABLE_SEARCH_INDEX
+/// emsh_hist_search() for a query of 3 characters or more, along the chain of one of its trigrams;
+/// costs O(m log n) for m occurrences of the rarest trigram of the query, whatever the number n of entries
+static size_t emsh_hist_search_index(emsh_hist_t *self, size_t from, const char *query, size_t query_len)
+{
+	const unsigned char *q = (const unsigned char *)query;
+
+	// the trigram of the query with the fewest occurrences, at k
+	size_t k = 0;
+	const emsh_hist_trigram_t *t = emsh_hist_trigram(self, &q[0]);
+	for (size_t i = 1; i + 3 <= query_len; ++i)
+	{
+		const emsh_hist_trigram_t *u = emsh_hist_trigram(self, &q[i]);
+		if (u->count < t->count)
+		{
+			t = u;
+			k = i;
+		}
+	}
+
+	// the occurrences past the entry of age from are in newer entries
+	size_t from_off = self->ring[emsh_hist_ring_index(self, from)].off;
+	size_t limit = emsh_hist_lin(self, from_off) + EMSH_HIST_ENTRY_SIZE(emsh_hist_get_len(self, from_off));
+	size_t prev_lin = SIZE_MAX;
+
+	for (size_t off = t->newest; emsh_hist_in_arena(self, off); off = self->chain[off])
+	{
+		size_t lin = emsh_hist_lin(self, off);
+		if (lin >= prev_lin)
+		{
+			break; // overwritten since it was chained, so are the older ones
+		}
+		prev_lin = lin;
+
+		if (lin >= limit || off < k || off - k + query_len > self->mem_size ||
+		    memcmp(&self->mem[off - k], query, query_len) != 0)
+		{
+			continue;
+		}
+
+		// a match unless it crosses the bounds of a live entry
+		size_t age = emsh_hist_age_at(self, off);
+		if (age != 0)
+		{
+			size_t ent = self->ring[emsh_hist_ring_index(self, age)].off;
+			if (off - k >= ent + 2 && off - k + query_len <= ent + EMSH_HIST_ENTRY_SIZE(emsh_hist_get_len(self, ent)))
+			{
+				return age;
+			}
+		}
+	}
+
+	return 0;
+}
+#endif
+
+#if EMSH_ENABLE_SEARCH
+/// the age of the newest entry from age `from` containing the query, or 0
+static size_t emsh_hist_search(emsh_hist_t *self, size_t from, const char *query, size_t query_len)
+{
+	if (from == 0)
+	{
+		from = 1;
+	}
+	if (from > self->size)
+	{
+		return 0;
+	}
+
+#if EMSH_ENABLE_SEARCH_INDEX
+	if (query_len >= 3)
+	{
+		return emsh_hist_search_index(self, from, query, query_len);
+	}
+#else
+	uint64_t sig = emsh_hist_sig(query, query_len);
+#endif
+
+	// a scan, with the signatures or for the queries without a trigram
+	for (size_t age = from; age <= self->size; ++age)
+	{
+		const emsh_hist_slot_t *slot = &self->ring[emsh_hist_ring_index(self, age)];
+#if !EMSH_ENABLE_SEARCH_INDEX
+		if ((slot->sig & sig) != sig)
+		{
+			continue;
+		}
+#endif
+
+		size_t len = emsh_hist_get_len(self, slot->off);
+		const char *str = (const char *)&self->mem[slot->off + 2];
+		for (size_t i = 0; i + query_len <= len; ++i)
+		{
+			if (memcmp(&str[i], query, query_len) == 0)
+			{
+				return age;
+			}
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/// back to the draft
+static void emsh_hist_rewind(emsh_hist_t *self)
+{
+	self->pos = 0;
+}
+
+static bool emsh_hist_move_backward(emsh_hist_t *self)
+{
+	if (self->pos < self->size)
+	{
+		++self->pos;
+		return true;
+	}
+
+	return false;
+}
+
+static bool emsh_hist_move_forward(emsh_hist_t *self)
+{
+	if (self->pos > 0)
+	{
+		--self->pos;
+		return true;
+	}
+
+	return false;
+}
+
+#if EMSH_ENABLE_PREFIX_SEARCH
+/// moves to the next older (or newer) entry starting with prefix; back to the draft past the newest one;
+/// costs O(log n + min(m, d)) for m entries starting with prefix and the nearest one d entries away
+static bool emsh_hist_move_prefix(emsh_hist_t *self, const char *prefix, size_t len, bool older)
+{
+	if (len == 0)
+	{
+		return older ? emsh_hist_move_backward(self) : emsh_hist_move_forward(self);
+	}
+	else if (!older && self->pos == 0)
+	{
+		return false;
+	}
+
+	size_t cur = (self->pos == 0) ? SIZE_MAX : emsh_hist_lin(self, self->ring[emsh_hist_ring_index(self, self->pos)].off);
+	size_t best = SIZE_MAX;
+	size_t best_lin = 0;
+
+	// the range of the entries starting with prefix
+	size_t lo = emsh_hist_lower_bound(self, prefix, len, 0);
+	size_t hi = lo;
+	size_t end = self->size;
+	while (hi < end)
+	{
+		size_t mid = hi + (end - hi) / 2;
+		if (emsh_hist_has_prefix(self, self->sorted[mid], prefix, len))
+		{
+			hi = mid + 1;
+		}
+		else
+		{
+			end = mid;
+		}
+	}
+
+	// the range is sorted by characters first, so the nearest match in the direction
+	// is found either by scanning it or by stepping through the ring from the current
+	// entry; both run in turn and the one done first gives the answer
+	size_t age = self->pos;
+	for (size_t i = lo; ; ++i)
+	{
+		age = older ? age + 1 : age - 1;
+		if (age == 0 || age > self->size)
+		{
+			break; // no match
+		}
+		if (emsh_hist_has_prefix(self, self->ring[emsh_hist_ring_index(self, age)].off, prefix, len))
+		{
+			break;
+		}
+
+		if (i == hi)
+		{
+			age = (best != SIZE_MAX) ? emsh_hist_age_of(self, best) : 0;
+			break;
+		}
+		size_t lin = emsh_hist_lin(self, self->sorted[i]);
+		if (older ? (lin < cur && (best == SIZE_MAX || lin > best_lin))
+		          : (lin > cur && (best == SIZE_MAX || lin < best_lin)))
+		{
+			best = self->sorted[i];
+			best_lin = lin;
+		}
+	}
+
+	if (age != 0 && age <= self->size)
+	{
+		self->pos = age;
+		return true;
+	}
+	else if (!older)
+	{
+		self->pos = 0;
+		return true;
+	}
+
+	return false;
+}
+#endif
+
+#if EMSH_ENABLE_SHARED_HIST
+/*
+ * Shared history
+ *
+ * A ring of n_slots fixed-size slots shared by the sessions. Committing an
+ * entry takes the next ticket with one atomic increment and writes the slot
+ * of the ticket modulo n_slots: there's no lock, so a session never waits
+ * for another one.
+ *
+ * Each slot is guarded by a sequence number (a seqlock): 2 * ticket + 1
+ * while the writer of that ticket copies the characters, 2 * ticket + 2 once
+ * its entry is complete. A writer owns the slot before touching the
+ * characters: it swaps the number from an even value of an older ticket to
+ * its odd one, and drops its entry if the slot is being written or a newer
+ * ticket already took it. Hence only the owner writes the characters, and a
+ * reader which finds 2 * ticket + 2 both before and after copying them got
+ * the entry of ticket whole; otherwise the entry is treated as gone.
+ *
+ * An entry is dropped when a writer is lapped, so n_slots should be well
+ * above the number of sessions.
+ */
+
+void emsh_shared_hist_init(emsh_shared_hist_t *self, emsh_shared_hist_slot_t *slots, atomic_uchar *mem, size_t n_slots, size_t max_line_size)
+{
+	assert(slots != NULL);
+	assert(mem != NULL);
+	assert(n_slots != 0);
+
+	atomic_init(&self->tail, 0);
+	for (size_t i = 0; i < n_slots; ++i)
+	{
+		atomic_init(&slots[i].seq, 0);
+		atomic_init(&slots[i].len, 0);
+	}
+	for (size_t i = 0; i < n_slots * max_line_size; ++i)
+	{
+		atomic_init(&mem[i], 0);
+	}
+	self->slots = slots;
+	self->mem = mem;
+	self->n_slots = n_slots;
+	self->max_line_size = max_line_size;
+}
+
+static void emsh_shared_hist_append(emsh_shared_hist_t *self, const char *line, size_t len)
+{
+	assert(len <= self->max_line_size);
+
+	size_t ticket = atomic_fetch_add_explicit(&self->tail, 1, memory_order_relaxed);
+	emsh_shared_hist_slot_t *slot = &self->slots[ticket % self->n_slots];
+	atomic_uchar *mem = &self->mem[ticket % self->n_slots * self->max_line_size];
+	size_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	size_t writing = 2 * ticket + 1;
+
+	do
+	{
+		if (seq % 2 != 0 || seq >= writing)
+		{
+			return; // lapped: the slot is being written or a newer entry took it
+		}
+	}
+	while (!atomic_compare_exchange_weak_explicit(&slot->seq, &seq, writing, memory_order_relaxed, memory_order_relaxed));
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&slot->len, len, memory_order_relaxed);
+	for (size_t i = 0; i < len; ++i)
+	{
+		atomic_store_explicit(&mem[i], (unsigned char)line[i], memory_order_relaxed);
+	}
+
+	atomic_store_explicit(&slot->seq, writing + 1, memory_order_release);
+}
+
+/// copies the entry of ticket into line; false if it's gone or not complete yet
+static bool emsh_shared_hist_read(emsh_shared_hist_t *self, size_t ticket, char *line, size_t *p_len)
+{
+	emsh_shared_hist_slot_t *slot = &self->slots[ticket % self->n_slots];
+	atomic_uchar *mem = &self->mem[ticket % self->n_slots * self->max_line_size];
+	size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+	if (seq != 2 * ticket + 2)
+	{
+		return false;
+	}
+
+	size_t len = atomic_load_explicit(&slot->len, memory_order_relaxed);
+	if (len > self->max_line_size)
+	{
+		return false;
+	}
+	for (size_t i = 0; i < len; ++i)
+	{
+		line[i] = (char)atomic_load_explicit(&mem[i], memory_order_relaxed);
+	}
+	line[len] = '\0';
+
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+	{
+		return false;
+	}
+
+	*p_len = len;
+	return true;
+}
+#endif
+
+/*
+ * Sizes
+ */
+
+static size_t emsh_max_line_size(const emsh_t *self)
+{
+#if EMSH_ENABLE_RUNTIME_SIZE
+	return self->max_line_size;
+#else
+	(void)self;
+	return EMSH_MAX_LINE_SIZE;
+#endif
+}
+
+static int emsh_max_n_args(const emsh_t *self)
+{
+#if EMSH_ENABLE_RUNTIME_SIZE
+	return self->cmd.max_n_args;
+#else
+	(void)self;
+	return EMSH_MAX_N_ARGS;
+#endif
+}
+
+/// (re)loads the line being edited from its terminated storage
+static void emsh_load_line(emsh_t *self)
+{
+	emsh_buf_init(&self->buf, self->line, emsh_max_line_size(self));
+}
+
+/*
+ * Write
+ */
+
+#if EMSH_ENABLE_OUTPUT_BUFFER
+static bool emsh_out_buffered(const emsh_t *self)
+{
+	return bytearray_capacity(&self->out.buf) != 0;
+}
+
+/// hands the buffered output to ops.write_strn
+static void emsh_out_drain(emsh_t *self)
+{
+	if (!bytearray_empty(&self->out.buf))
+	{
+		self->ops.write_strn(self->cookie,
+		                     (const char *)bytearray_data_const(&self->out.buf),
+		                     bytearray_size(&self->out.buf));
+		bytearray_clear(&self->out.buf);
+#if EMSH_ENABLE_STATS
+		--self->stats.n_writes_saved;
+#endif
+	}
+}
+#endif
+
+/// ends a batch of output
+static void emsh_out_flush(emsh_t *self)
+{
+#if EMSH_ENABLE_OUTPUT_BUFFER
+	emsh_out_drain(self);
+#endif
+	if (self->out.dirty)
+	{
+		self->out.dirty = false;
+		if (self->ops.flush != NULL)
+		{
+			self->ops.flush(self->cookie);
+		}
+	}
+}
+
+static void emsh_write_strn(emsh_t *self, const char *str, size_t len)
+{
+	self->out.dirty = true;
+#if EMSH_ENABLE_OUTPUT_BUFFER
+	if (emsh_out_buffered(self))
+	{
+		if (bytearray_room(&self->out.buf) < len)
+		{
+			emsh_out_drain(self);
+		}
+		if (bytearray_room(&self->out.buf) >= len)
+		{
+			bytearray_push_back_n(&self->out.buf, (const bytearray_datum_t *)str, len);
+#if EMSH_ENABLE_STATS
+			++self->stats.n_writes_saved;
+#endif
+			return;
+		}
+		// too long to be buffered
+	}
+#endif
+	self->ops.write_strn(self->cookie, str, len);
+}
+
+// str should be a compile-time constant
+#define emsh_write_str(self, str) emsh_write_strn(self, str, strlen(str))
+
+static void emsh_write_iov(emsh_t *self, const emsh_iov_t *iov, size_t n)
+{
+#if EMSH_ENABLE_OUTPUT_BUFFER
+	if (emsh_out_buffered(self))
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			emsh_write_strn(self, iov[i].base, iov[i].len);
+		}
+		return;
+	}
+#endif
+	if (self->ops.write_iov != NULL)
+	{
+		self->out.dirty = true;
+		self->ops.write_iov(self->cookie, iov, n);
+	}
+	else
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (iov[i].len != 0)
+			{
+				emsh_write_strn(self, iov[i].base, iov[i].len);
+			}
+		}
+	}
+}
+
+// str should be a compile-time constant
+#define EMSH_IOV_STR(str) {.base = (str), .len = sizeof(str) - 1}
+
+static void emsh_write_prompt(emsh_t *self)
+{
+	emsh_write_str(self, EMSH_S_PROMPT);
+}
+
+static void emsh_write_newline(emsh_t *self)
+{
+	emsh_write_str(self, EMSH_S_NEWLINE);
+}
+
+#define EMSH_CTLSEQ_1_SIZE (2+NUMCAST10_SIZE_OF(uint_fast32_t)+1+1) // CSI P ... P (I) F
+
+static size_t emsh_format_ctlseq_1(char buf[EMSH_CTLSEQ_1_SIZE], uint_fast32_t param_val, char interm_byte, char final_byte)
+{
+	size_t len = 0;
+
+	// CSI
+	buf[len + 0] = CTLSEQ_C_CSI_1;
+	buf[len + 1] = CTLSEQ_C_CSI_2;
+	len += 2;
+
+	// P ... P
+	len += numcast10_from_uint_fast32_t(&buf[len], param_val);
+
+	// (I)
+	if (interm_byte != 0x00)
+	{
+		buf[len] = interm_byte;
+		++len;
+	}
+
+	// F
+	buf[len] = final_byte;
+	++len;
+
+	return len;
+}
+
+/// a control function taking a count which defaults to 1 (CUB, ICH, DCH, ...); nothing for n == 0
+static size_t emsh_format_ctlseq_n(char buf[EMSH_CTLSEQ_1_SIZE], uint_fast32_t n, char final_byte)
+{
+	if (n == 0)
+	{
+		return 0;
+	}
+	else if (n == 1)
+	{
+		buf[0] = CTLSEQ_C_CSI_1;
+		buf[1] = CTLSEQ_C_CSI_2;
+		buf[2] = final_byte;
+		return 3;
+	}
+	else
+	{
+		return emsh_format_ctlseq_1(buf, n, 0x00, final_byte);
+	}
+}
+
+/*
+ * Cursor motion
+ */
+
+/// length of emsh_format_ctlseq_n()
+static size_t emsh_ctlseq_n_len(size_t n)
+{
+	size_t len = 3; // CSI F
+
+	if (n == 0)
+	{
+		return 0;
+	}
+	else if (n == 1)
+	{
+		return len; // the parameter defaults to 1
+	}
+
+	for (; n != 0; n /= 10) ++len;
+	return len;
+}
+
+#define EMSH_CUR_PLAN_MAX_IOV 4 // CR, prompt and the line split by the gap
+#define EMSH_CUR_PLAN_SEQ_SIZE (1+EMSH_CTLSEQ_1_SIZE) // (CR) CSI P ... P F
+
+/// picks the shortest byte sequence moving the cursor from one position of the line to another:
+/// CUF/CUB, retyping the characters in between, CR + CUF, CR + prompt + retyping, or CHA.
+/// fills iov (seq is a storage for control sequences) and returns the number of entries
+static size_t emsh_cur_plan(emsh_t *self, size_t from, size_t to,
+                            char seq[EMSH_CUR_PLAN_SEQ_SIZE], emsh_iov_t iov[EMSH_CUR_PLAN_MAX_IOV])
+{
+	enum { REL, RETYPE, CR_CUF, CR_RETYPE, CHA } how = REL;
+	const size_t prompt_len = sizeof(EMSH_S_PROMPT) - 1;
+	size_t col = prompt_len + to; // 0-origin
+	size_t len, best_len;
+
+	assert(to <= emsh_buf_size(&self->buf)); // from may be past the end of a line just replaced
+
+	if (from == to)
+	{
+		return 0;
+	}
+
+	best_len = emsh_ctlseq_n_len(from < to ? to - from : from - to);
+	if (from < to && (len = to - from) < best_len)
+	{
+		how = RETYPE;
+		best_len = len;
+	}
+	if ((len = 1 + emsh_ctlseq_n_len(col)) < best_len)
+	{
+		how = CR_CUF;
+		best_len = len;
+	}
+	if ((len = 1 + col) < best_len)
+	{
+		how = CR_RETYPE;
+		best_len = len;
+	}
+	if ((len = emsh_ctlseq_n_len(col + 1)) < best_len)
+	{
+		how = CHA;
+		best_len = len;
+	}
+
+	switch (how)
+	{
+	case REL:
+		iov[0].base = seq;
+		iov[0].len = from < to ? emsh_format_ctlseq_n(seq, (uint_fast32_t)(to - from), CTLSEQ_C_CUF)
+		                       : emsh_format_ctlseq_n(seq, (uint_fast32_t)(from - to), CTLSEQ_C_CUB);
+		return 1;
+	case RETYPE:
+		return emsh_buf_iov(&self->buf, from, to, iov);
+	case CR_CUF:
+		seq[0] = ASCII_C_CR;
+		iov[0].base = seq;
+		iov[0].len = 1 + emsh_format_ctlseq_n(seq + 1, (uint_fast32_t)col, CTLSEQ_C_CUF);
+		return 1;
+	case CR_RETYPE:
+		iov[0].base = ASCII_S_CR;
+		iov[0].len = 1;
+		iov[1].base = EMSH_S_PROMPT;
+		iov[1].len = prompt_len;
+		return 2 + emsh_buf_iov(&self->buf, 0, to, &iov[2]);
+	case CHA:
+		iov[0].base = seq;
+		iov[0].len = emsh_format_ctlseq_n(seq, (uint_fast32_t)(col + 1), CTLSEQ_C_CHA);
+		return 1;
+	}
+
+	assert(0);
+	return 0;
+}
+
+static void emsh_cur_move(emsh_t *self, size_t from, size_t to)
+{
+	char seq[EMSH_CUR_PLAN_SEQ_SIZE];
+	emsh_iov_t iov[EMSH_CUR_PLAN_MAX_IOV];
+	size_t n = emsh_cur_plan(self, from, to, seq, iov);
+
+	if (n != 0)
+	{
+		emsh_write_iov(self, iov, n);
+	}
+}
+
+/*
+ * Display
+ */
+
+#if !EMSH_ENABLE_ICH_DCH
+/// echoes n_echo characters before the cursor, then redraws the rest of the line
+static void emsh_disp_refresh_cur_to_eol(emsh_t *self, size_t n_echo)
+{
+	size_t size = emsh_buf_size(&self->buf);
+	size_t pos = emsh_buf_pos(&self->buf);
+	char seq[EMSH_CUR_PLAN_SEQ_SIZE];
+	emsh_iov_t iov[2 + 1 + 2 + EMSH_CUR_PLAN_MAX_IOV];
+	size_t n = 0;
+
+	assert(n_echo <= pos);
+
+	n += emsh_buf_iov(&self->buf, pos - n_echo, pos, &iov[n]);
+	iov[n].base = CTLSEQ_S_CSI CTLSEQ_S_EL;
+	iov[n].len = 3;
+	++n;
+	n += emsh_buf_iov(&self->buf, pos, size, &iov[n]);
+	n += emsh_cur_plan(self, size, pos, seq, &iov[n]); // back from the end of line
+	emsh_write_iov(self, iov, n);
+}
+#endif
+
+#if EMSH_ENABLE_ICH_DCH
+/// inserts the n characters before the cursor with ICH instead of retyping the rest of the line
+static void emsh_disp_insert(emsh_t *self, size_t n)
+{
+	size_t pos = emsh_buf_pos(&self->buf);
+	char ich[EMSH_CTLSEQ_1_SIZE];
+	emsh_iov_t iov[1 + 2];
+
+	assert(n <= pos);
+
+	iov[0].base = ich;
+	iov[0].len = 0;
+	if (pos != emsh_buf_size(&self->buf))
+	{
+		iov[0].len = emsh_format_ctlseq_n(ich, (uint_fast32_t)n, CTLSEQ_C_ICH);
+	}
+
+	emsh_write_iov(self, iov, 1 + emsh_buf_iov(&self->buf, pos - n, pos, &iov[1]));
+}
+
+/// deletes the character at the cursor with DCH
+static void emsh_disp_erase(emsh_t *self)
+{
+	emsh_write_str(self, CTLSEQ_S_CSI CTLSEQ_S_DCH);
+}
+#else
+static void emsh_disp_insert(emsh_t *self, size_t n)
+{
+	emsh_disp_refresh_cur_to_eol(self, n);
+}
+
+static void emsh_disp_erase(emsh_t *self)
+{
+	emsh_disp_refresh_cur_to_eol(self, 0);
+}
+#endif
+
+#if EMSH_ENABLE_DIFF_REDRAW
+/// redraws the line which replaced the one on screen by sending only the changed suffix;
+/// both share the first n_same characters
+static void emsh_disp_redraw_line(emsh_t *self, size_t n_same, size_t old_size, size_t old_pos)
+{
+	size_t size = emsh_buf_size(&self->buf);
+	const char *data = emsh_buf_data(&self->buf);
+	char seq[EMSH_CUR_PLAN_SEQ_SIZE];
+	emsh_iov_t iov[EMSH_CUR_PLAN_MAX_IOV + 2];
+	size_t n = 0;
+	size_t pos = n_same;
+
+	if (old_pos > pos)
+	{
+		n = emsh_cur_plan(self, old_pos, pos, seq, iov);
+	}
+	else
+	{
+		pos = old_pos; // retype the unchanged characters up to the first difference
+	}
+
+	iov[n].base = data + pos;
+	iov[n].len = size - pos;
+	++n;
+	if (size < old_size)
+	{
+		iov[n].base = CTLSEQ_S_CSI CTLSEQ_S_EL;
+		iov[n].len = 3;
+		++n;
+	}
+	emsh_write_iov(self, iov, n);
+
+#if EMSH_ENABLE_STATS
+	size_t len = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		len += iov[i].len;
+	}
+	size_t full_len = 1 + 3 + strlen(EMSH_S_PROMPT) + size; // see emsh_disp_refresh_line()
+	self->stats.n_redraw_bytes_saved += full_len - len;
+#endif
+}
+#else
+static void emsh_disp_refresh_line(emsh_t *self)
+{
+	emsh_iov_t iov[] = {
+		EMSH_IOV_STR(ASCII_S_CR CTLSEQ_S_CSI CTLSEQ_S_EL),
+		EMSH_IOV_STR(EMSH_S_PROMPT),
+		{.base = emsh_buf_data(&self->buf), .len = emsh_buf_size(&self->buf)},
+	};
+	emsh_write_iov(self, iov, sizeof(iov)/sizeof(*iov));
+}
+#endif
+
+/*
+ * Cursor
+ */
+
+static void emsh_cur_move_forward(emsh_t *self)
+{
+	size_t pos = emsh_buf_pos(&self->buf);
+
+	assert(pos < emsh_buf_size(&self->buf));
+
+	emsh_cur_move(self, pos, pos + 1);
+	emsh_buf_inc_pos(&self->buf);
+}
+
+static void emsh_cur_move_backward(emsh_t *self)
+{
+	size_t pos = emsh_buf_pos(&self->buf);
+
+	assert(pos > 0);
+
+	emsh_cur_move(self, pos, pos - 1);
+	emsh_buf_dec_pos(&self->buf);
+}
+
+static void emsh_cur_set_pos(emsh_t *self, size_t pos)
+{
+	assert(pos <= emsh_buf_size(&self->buf));
+
+	emsh_cur_move(self, emsh_buf_pos(&self->buf), pos);
+	emsh_buf_set_pos(&self->buf, pos);
+}
+
+/*
+ * Command processor
+ */
+
+/*
+ * The line is split by a state machine reading one character at a time:
+ *
+ *  - blank: between arguments
+ *  - word: in an argument, outside quotes
+ *  - squote: in '...', where every character is taken as is
+ *  - dquote: in "...", where \ only escapes " and \
+ *  - escape, dquote_escape: after a \
+ *
+ * The arguments are unescaped into the draft, each one terminated.
+ */
+
+enum
+{
+	EMSH_LEX_OTHER,
+	EMSH_LEX_SPACE,
+	EMSH_LEX_SQUOTE,
+	EMSH_LEX_DQUOTE,
+	EMSH_LEX_BSLASH,
+	EMSH_LEX_N_CLASSES,
+};
+
+enum
+{
+	EMSH_LEX_BLANK,
+	EMSH_LEX_WORD,
+	EMSH_LEX_IN_SQUOTE,
+	EMSH_LEX_IN_DQUOTE,
+	EMSH_LEX_ESCAPE,
+	EMSH_LEX_DQUOTE_ESCAPE,
+	EMSH_LEX_N_STATES,
+};
+
+#define EMSH_LEX_BEGIN 0x10 ///< starts an argument
+#define EMSH_LEX_END 0x20 ///< terminates the argument
+#define EMSH_LEX_PUT 0x40 ///< appends the character
+#define EMSH_LEX_PUT_BSLASH 0x80 ///< appends a \ first
+#define EMSH_LEX_STATE 0x0F
+
+static const unsigned char emsh_lex_table[EMSH_LEX_N_STATES][EMSH_LEX_N_CLASSES] = {
+	[EMSH_LEX_BLANK] = {
+		[EMSH_LEX_OTHER] = EMSH_LEX_WORD | EMSH_LEX_BEGIN | EMSH_LEX_PUT,
+		[EMSH_LEX_SPACE] = EMSH_LEX_BLANK,
+		[EMSH_LEX_SQUOTE] = EMSH_LEX_IN_SQUOTE | EMSH_LEX_BEGIN,
+		[EMSH_LEX_DQUOTE] = EMSH_LEX_IN_DQUOTE | EMSH_LEX_BEGIN,
+		[EMSH_LEX_BSLASH] = EMSH_LEX_ESCAPE | EMSH_LEX_BEGIN,
+	},
+	[EMSH_LEX_WORD] = {
+		[EMSH_LEX_OTHER] = EMSH_LEX_WORD | EMSH_LEX_PUT,
+		[EMSH_LEX_SPACE] = EMSH_LEX_BLANK | EMSH_LEX_END,
+		[EMSH_LEX_SQUOTE] = EMSH_LEX_IN_SQUOTE,
+		[EMSH_LEX_DQUOTE] = EMSH_LEX_IN_DQUOTE,
+		[EMSH_LEX_BSLASH] = EMSH_LEX_ESCAPE,
+	},
+	[EMSH_LEX_IN_SQUOTE] = {
+		[EMSH_LEX_OTHER] = EMSH_LEX_IN_SQUOTE | EMSH_LEX_PUT,
+		[EMSH_LEX_SPACE] = EMSH_LEX_IN_SQUOTE | EMSH_LEX_PUT,
+		[EMSH_LEX_SQUOTE] = EMSH_LEX_WORD,
+		[EMSH_LEX_DQUOTE] = EMSH_LEX_IN_SQUOTE | EMSH_LEX_PUT,
+		[EMSH_LEX_BSLASH] = EMSH_LEX_IN_SQUOTE | EMSH_LEX_PUT,
+	},
+	[EMSH_LEX_IN_DQUOTE] = {
+		[EMSH_LEX_OTHER] = EMSH_LEX_IN_DQUOTE | EMSH_LEX_PUT,
+		[EMSH_LEX_SPACE] = EMSH_LEX_IN_DQUOTE | EMSH_LEX_PUT,
+		[EMSH_LEX_SQUOTE] = EMSH_LEX_IN_DQUOTE | EMSH_LEX_PUT,
+		[EMSH_LEX_DQUOTE] = EMSH_LEX_WORD,
+		[EMSH_LEX_BSLASH] = EMSH_LEX_DQUOTE_ESCAPE,
+	},
+	[EMSH_LEX_ESCAPE] = {
+		[EMSH_LEX_OTHER] = EMSH_LEX_WORD | EMSH_LEX_PUT,
+		[EMSH_LEX_SPACE] = EMSH_LEX_WORD | EMSH_LEX_PUT,
+		[EMSH_LEX_SQUOTE] = EMSH_LEX_WORD | EMSH_LEX_PUT,
+		[EMSH_LEX_DQUOTE] = EMSH_LEX_WORD | EMSH_LEX_PUT,
+		[EMSH_LEX_BSLASH] = EMSH_LEX_WORD | EMSH_LEX_PUT,
+	},
+	[EMSH_LEX_DQUOTE_ESCAPE] = {
+		[EMSH_LEX_OTHER] = EMSH_LEX_IN_DQUOTE | EMSH_LEX_PUT_BSLASH | EMSH_LEX_PUT,
+		[EMSH_LEX_SPACE] = EMSH_LEX_IN_DQUOTE | EMSH_LEX_PUT_BSLASH | EMSH_LEX_PUT,
+		[EMSH_LEX_SQUOTE] = EMSH_LEX_IN_DQUOTE | EMSH_LEX_PUT_BSLASH | EMSH_LEX_PUT,
+		[EMSH_LEX_DQUOTE] = EMSH_LEX_IN_DQUOTE | EMSH_LEX_PUT,
+		[EMSH_LEX_BSLASH] = EMSH_LEX_IN_DQUOTE | EMSH_LEX_PUT,
+	},
+};
+
+static unsigned emsh_lex_class(char ch)
+{
+	switch (ch)
+	{
+	case ' ':
+		return EMSH_LEX_SPACE;
+	case '\'':
+		return EMSH_LEX_SQUOTE;
+	case '"':
+		return EMSH_LEX_DQUOTE;
+	case '\\':
+		return EMSH_LEX_BSLASH;
+	default:
+		return EMSH_LEX_OTHER;
+	}
+}
+
+/// updates cmd.argc and cmd.args, leaving the line as it is;
+/// returns false after an error message if a quote isn't closed
+static bool emsh_cmd_split(emsh_t *self)
+{
+	size_t size = emsh_buf_size(&self->buf);
+	const char *data = emsh_buf_data(&self->buf);
+	char *out = self->draft; // not in use while committing; the arguments never outgrow the line
+	unsigned st = EMSH_LEX_BLANK;
+
+	self->cmd.argc = 0;
+
+	for (size_t pos = 0; pos < size; ++pos)
+	{
+		unsigned t = emsh_lex_table[st][emsh_lex_class(data[pos])];
+
+		if (t & EMSH_LEX_BEGIN)
+		{
+			if (self->cmd.argc == emsh_max_n_args(self))
+			{
+				++self->cmd.argc;
+				return true;
+			}
+			self->cmd.args[self->cmd.argc].base = out;
+		}
+		if (t & EMSH_LEX_PUT_BSLASH)
+		{
+			*out++ = '\\';
+		}
+		if (t & EMSH_LEX_PUT)
+		{
+			*out++ = data[pos];
+		}
+		if (t & EMSH_LEX_END)
+		{
+			self->cmd.args[self->cmd.argc].len = (size_t)(out - self->cmd.args[self->cmd.argc].base);
+			*out++ = '\0';
+			++self->cmd.argc;
+		}
+		st = t & EMSH_LEX_STATE;
+	}
+
+	switch (st)
+	{
+	case EMSH_LEX_IN_SQUOTE:
+		emsh_write_str(self, "emsh: Unmatched '." EMSH_S_NEWLINE);
+		return false;
+	case EMSH_LEX_IN_DQUOTE:
+	case EMSH_LEX_DQUOTE_ESCAPE:
+		emsh_write_str(self, "emsh: Unmatched \"." EMSH_S_NEWLINE);
+		return false;
+	case EMSH_LEX_ESCAPE:
+		*out++ = '\\'; // a trailing \ is taken as is
+		// fall through
+	case EMSH_LEX_WORD:
+		self->cmd.args[self->cmd.argc].len = (size_t)(out - self->cmd.args[self->cmd.argc].base);
+		*out = '\0';
+		++self->cmd.argc;
+		break;
+	default:
+		break;
+	}
+	return true;
+}
+
+const char **emsh_argv(emsh_t *self)
+{
+	for (int i = 0; i < self->cmd.argc; ++i)
+	{
+		self->cmd.argv[i] = self->cmd.args[i].base;
+	}
+
+	return self->cmd.argv;
+}
+
+static void emsh_cmd_exec(emsh_t *self)
+{
+#if EMSH_ENABLE_GETOPT
+	self->cmd.optpos = 1;
+	emsh_optind = 1;
+#endif
+	emsh_out_flush(self); // keep the order with the output of the command
+	if (self->ops.exec_spans != NULL)
+	{
+		self->ops.exec_spans(self->cookie, self->cmd.argc, self->cmd.args);
+	}
+	else
+	{
+		self->ops.exec(self->cookie, self->cmd.argc, emsh_argv(self));
+	}
+}
+
+#if EMSH_ENABLE_HIST_EXPANSION
+/// replaces !! and !-N with the Nth newest history entry, and !N with the Nth oldest one,
+/// except in '...' and after a \ as the lexer reads them;
+/// returns false after an error message if an event can't be expanded
+static bool emsh_cmd_expand(emsh_t *self)
+{
+	size_t size = emsh_buf_size(&self->buf);
+	char *data = emsh_buf_data(&self->buf);
+	char *out = self->draft; // not in use while committing
+	size_t max_len = emsh_max_line_size(self);
+	size_t len = 0;
+	bool expanded = false;
+	unsigned st = EMSH_LEX_BLANK;
+
+	for (size_t pos = 0; pos < size; )
+	{
+		// the event designator is [pos, end)
+		size_t end = pos + 1;
+		size_t age = 0;
+		bool quoted = (st != EMSH_LEX_BLANK && st != EMSH_LEX_WORD && st != EMSH_LEX_IN_DQUOTE);
+		st = emsh_lex_table[st][emsh_lex_class(data[pos])] & EMSH_LEX_STATE; // an event reads as a word
+		if (data[pos] != '!' || end == size || quoted)
+		{
+			end = pos;
+		}
+		else if (data[end] == '!')
+		{
+			age = 1;
+			++end;
+		}
+		else
+		{
+			bool relative = (data[end] == '-');
+			size_t n = 0;
+			size_t digits = end + relative;
+			for (end = digits; end < size && ascii_isdigit(data[end]); ++end)
+			{
+				if (n <= emsh_hist_capacity(&self->hist))
+				{
+					n = n * 10 + (size_t)(data[end] - '0'); // saturates past any age
+				}
+			}
+			if (end == digits)
+			{
+				end = pos; // just a '!'
+			}
+			else
+			{
+				age = relative ? n : (n <= self->hist.size ? self->hist.size + 1 - n : 0);
+			}
+		}
+
+		if (end == pos)
+		{
+			if (len == max_len)
+			{
+				emsh_write_str(self, "emsh: Line too long." EMSH_S_NEWLINE);
+				return false;
+			}
+			out[len] = data[pos];
+			++len;
+			++pos;
+			continue;
+		}
+
+		size_t ent_len;
+		const char *ent = emsh_hist_at(&self->hist, age, &ent_len);
+		if (ent == NULL)
+		{
+			emsh_iov_t iov[] = {
+				EMSH_IOV_STR("emsh: "),
+				{.base = &data[pos], .len = end - pos},
+				EMSH_IOV_STR(": event not found" EMSH_S_NEWLINE),
+			};
+			emsh_write_iov(self, iov, sizeof(iov)/sizeof(*iov));
+			return false;
+		}
+		if (ent_len > max_len - len)
+		{
+			emsh_write_str(self, "emsh: Line too long." EMSH_S_NEWLINE);
+			return false;
+		}
+		memcpy(&out[len], ent, ent_len);
+		len += ent_len;
+		pos = end;
+		expanded = true;
+	}
+
+	if (expanded)
+	{
+		memcpy(self->line, out, len);
+		self->line[len] = '\0';
+		emsh_load_line(self);
+
+		// show what is going to run
+		emsh_iov_t iov[] = {
+			{.base = self->line, .len = len},
+			EMSH_IOV_STR(EMSH_S_NEWLINE),
+		};
+		emsh_write_iov(self, iov, sizeof(iov)/sizeof(*iov));
+	}
+	return true;
+}
+#endif
+
+static bool emsh_cmd_run(emsh_t *self)
+{
+	if (!emsh_cmd_split(self))
+	{
+		return true; // kept in the history to be fixed
+	}
+	if (self->cmd.argc == 0)
+	{
+		// ignore
+	}
+	else if (self->cmd.argc <= emsh_max_n_args(self))
+	{
+		emsh_cmd_exec(self);
+	}
+	else
+	{
+		emsh_write_str(self, "emsh: Argument list too long." EMSH_S_NEWLINE);
+	}
+
+	return self->cmd.argc != 0;
+}
+
+/*
+ * Actions
+ */
+
+/// runs the line, adds it to the history if hist and starts a new one
+static void emsh_commit(emsh_t *self, bool hist)
+{
+#if EMSH_ENABLE_HIST_EXPANSION
+	bool ok = emsh_cmd_expand(self);
+#else
+	bool ok = true;
+#endif
+	if (ok && emsh_cmd_run(self) && hist)
+	{
+		if (emsh_hist_commit(&self->hist, emsh_buf_data(&self->buf), emsh_buf_size(&self->buf)))
+		{
+			if (self->ops.hist_append != NULL)
+			{
+				self->ops.hist_append(self->cookie, emsh_buf_data(&self->buf), emsh_buf_size(&self->buf));
+			}
+#if EMSH_ENABLE_SHARED_HIST
+			if (self->shared.hist != NULL)
+			{
+				emsh_shared_hist_append(self->shared.hist, emsh_buf_data(&self->buf), emsh_buf_size(&self->buf));
+			}
+#endif
+		}
+	}
+	else
+	{
+		emsh_hist_rewind(&self->hist);
+	}
+#if EMSH_ENABLE_SHARED_HIST
+	self->shared.pos = 0;
+#endif
+	self->line[0] = '\0';
+	emsh_load_line(self);
+}
+
+static void emsh_do_commit(emsh_t *self)
+{
+	emsh_write_newline(self);
+	emsh_commit(self, true);
+
+	if (self->running)
+	{
+		emsh_write_prompt(self);
+	}
+}
+
+static void emsh_do_insert(emsh_t *self, int c)
+{
+	if (emsh_buf_size(&self->buf) < emsh_buf_capacity(&self->buf))
+	{
+		emsh_buf_insert(&self->buf, c);
+		emsh_disp_insert(self, 1);
+	}
+}
+
+/// inserts a run of printable characters with a single echo and refresh
+static void emsh_do_insert_n(emsh_t *self, const char *str, size_t len)
+{
+	size_t room = emsh_buf_capacity(&self->buf) - emsh_buf_size(&self->buf);
+	if (len > room)
+	{
+		len = room; // the rest is dropped as emsh_do_insert() does
+	}
+
+	if (len != 0)
+	{
+		emsh_buf_insert_n(&self->buf, str, len);
+		emsh_disp_insert(self, len);
+	}
+}
+
+static void emsh_do_erase(emsh_t *self)
+{
+	if (emsh_buf_pos(&self->buf) != emsh_buf_size(&self->buf))
+	{
+		emsh_buf_erase(&self->buf);
+		emsh_disp_erase(self);
+	}
+}
+
+/// start of line
+static void emsh_do_sol(emsh_t *self)
+{
+	emsh_cur_set_pos(self, 0);
+}
+
+/// end of line
+static void emsh_do_eol(emsh_t *self)
+{
+	emsh_cur_set_pos(self, emsh_buf_size(&self->buf));
+}
+
+/// replaces the line with len characters of str
+static void emsh_set_line(emsh_t *self, const char *str, size_t len)
+{
+	size_t old_size = emsh_buf_size(&self->buf);
+	size_t old_pos = emsh_buf_pos(&self->buf);
+	char *line = emsh_buf_data(&self->buf);
+
+	// keep the common prefix
+	size_t n_same = 0;
+	while (n_same < len && n_same < old_size && line[n_same] == str[n_same]) ++n_same;
+	memcpy(&line[n_same], &str[n_same], len - n_same);
+	line[len] = '\0';
+	emsh_load_line(self);
+
+#if EMSH_ENABLE_DIFF_REDRAW
+	emsh_disp_redraw_line(self, n_same, old_size, old_pos);
+#else
+	(void)old_pos;
+	emsh_disp_refresh_line(self);
+#endif
+}
+
+/// replaces the line with the history entry at the current position (the draft at 0)
+static void emsh_recall(emsh_t *self)
+{
+	const char *str = self->draft;
+	size_t len;
+
+#if EMSH_ENABLE_SHARED_HIST
+	if (self->shared.hist != NULL)
+	{
+		if (self->shared.pos == 0)
+		{
+			len = strlen(self->draft);
+		}
+		else
+		{
+			str = self->shared.line;
+			len = self->shared.len;
+		}
+		emsh_set_line(self, str, len);
+		return;
+	}
+#endif
+	if (self->hist.pos == 0)
+	{
+		len = strlen(self->draft);
+	}
+	else
+	{
+		str = emsh_hist_current(&self->hist, &len);
+	}
+	emsh_set_line(self, str, len);
+}
+
+#if EMSH_ENABLE_SHARED_HIST
+/// moves through the shared history as it was when browsing started, reading the entry
+static bool emsh_shared_browse(emsh_t *self, bool older)
+{
+	emsh_shared_hist_t *shared = self->shared.hist;
+	size_t pos = self->shared.pos;
+
+	if (older)
+	{
+		if (pos == 0)
+		{
+			self->shared.base = atomic_load_explicit(&shared->tail, memory_order_relaxed);
+			emsh_hist_rewind(&self->hist);
+		}
+		++pos;
+		if (pos > self->shared.base || pos > shared->n_slots ||
+		    !emsh_shared_hist_read(shared, self->shared.base - pos, self->shared.line, &self->shared.len))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		if (pos == 0)
+		{
+			return false;
+		}
+		--pos;
+		if (pos != 0 && !emsh_shared_hist_read(shared, self->shared.base - pos, self->shared.line, &self->shared.len))
+		{
+			pos = 0; // overwritten meanwhile, so are the older ones
+		}
+	}
+
+	self->shared.pos = pos;
+	return true;
+}
+#endif
+
+/// the line is a recalled entry rather than the draft
+static bool emsh_browsing(const emsh_t *self)
+{
+#if EMSH_ENABLE_SHARED_HIST
+	if (self->shared.pos != 0)
+	{
+		return true;
+	}
+#endif
+	return self->hist.pos != 0;
+}
+
+/// moves through the history, only to the entries starting with the draft when there's one
+static bool emsh_browse(emsh_t *self, bool older)
+{
+#if EMSH_ENABLE_SHARED_HIST
+	if (self->shared.hist != NULL)
+	{
+		return emsh_shared_browse(self, older);
+	}
+#endif
+#if EMSH_ENABLE_PREFIX_SEARCH
+	return emsh_hist_move_prefix(&self->hist, self->draft, self->prefix_len, older);
+#else
+	return older ? emsh_hist_move_backward(&self->hist) : emsh_hist_move_forward(&self->hist);
+#endif
+}
+
+/// cursor up
+static void emsh_do_cuu(emsh_t *self)
+{
+	if (!emsh_browsing(self))
+	{
+		memcpy(self->draft, emsh_buf_data(&self->buf), emsh_buf_size(&self->buf) + 1);
+#if EMSH_ENABLE_PREFIX_SEARCH
+		self->prefix_len = emsh_buf_size(&self->buf);
+#endif
+	}
+
+	if (emsh_browse(self, true))
+	{
+		emsh_recall(self);
+	}
+	else
+	{
+		emsh_do_eol(self);
+	}
+}
+
+/// cursor down
+static void emsh_do_cud(emsh_t *self)
+{
+	if (emsh_browse(self, false))
+	{
+		emsh_recall(self);
+	}
+	else
+	{
+		emsh_do_eol(self);
+	}
+}
+
+#if EMSH_ENABLE_SEARCH || EMSH_ENABLE_COMPLETION || EMSH_ENABLE_BRACKETED_PASTE
+/// shows the prompt and the line again, after the search status line, a list of candidates or a paste
+static void emsh_disp_line(emsh_t *self)
+{
+	size_t size = emsh_buf_size(&self->buf);
+	char seq[EMSH_CUR_PLAN_SEQ_SIZE];
+	emsh_iov_t iov[1 + 2 + 1 + EMSH_CUR_PLAN_MAX_IOV];
+	emsh_iov_t prompt = EMSH_IOV_STR(ASCII_S_CR EMSH_S_PROMPT);
+	emsh_iov_t el = EMSH_IOV_STR(CTLSEQ_S_CSI CTLSEQ_S_EL);
+	size_t n = 0;
+
+	iov[n++] = prompt;
+	n += emsh_buf_iov(&self->buf, 0, size, &iov[n]);
+	iov[n++] = el;
+	n += emsh_cur_plan(self, size, emsh_buf_pos(&self->buf), seq, &iov[n]);
+	emsh_write_iov(self, iov, n);
+}
+
+#endif
+
+#if EMSH_ENABLE_SEARCH
+/// shows the search status line in place of the line
+static void emsh_disp_search(emsh_t *self)
+{
+	size_t len;
+	const char *match = emsh_hist_at(&self->hist, self->search.age, &len);
+	if (match == NULL)
+	{
+		match = "";
+	}
+	emsh_iov_t iov[] = {
+		EMSH_IOV_STR(ASCII_S_CR "(reverse-i-search)'"),
+		{.base = self->search.query, .len = self->search.len},
+		EMSH_IOV_STR("': "),
+		{.base = match, .len = len},
+		EMSH_IOV_STR(CTLSEQ_S_CSI CTLSEQ_S_EL),
+	};
+	if (self->search.failed)
+	{
+		emsh_iov_t failed = EMSH_IOV_STR(ASCII_S_CR "(failed reverse-i-search)'");
+		iov[0] = failed;
+	}
+	emsh_write_iov(self, iov, sizeof(iov)/sizeof(*iov));
+}
+
+/// reverse-i-search; starts a search, or looks for an older match
+static void emsh_do_search(emsh_t *self)
+{
+	if (!self->search.active)
+	{
+		if (!emsh_browsing(self))
+		{
+			memcpy(self->draft, emsh_buf_data(&self->buf), emsh_buf_size(&self->buf) + 1);
+		}
+		self->search.active = true;
+		self->search.failed = false;
+		self->search.age = 0;
+		self->search.len = 0;
+	}
+	else if (self->search.len != 0)
+	{
+		size_t age = emsh_hist_search(&self->hist, self->search.age + 1, self->search.query, self->search.len);
+		if (age != 0)
+		{
+			self->search.age = age;
+		}
+		self->search.failed = (age == 0);
+	}
+	emsh_disp_search(self);
+}
+
+static void emsh_search_insert(emsh_t *self, char ch)
+{
+	if (self->search.len < EMSH_MAX_SEARCH_SIZE)
+	{
+		self->search.query[self->search.len] = ch;
+		++self->search.len;
+
+		// a longer query can't match where the shorter one failed, and the match is kept while it still matches
+		if (!self->search.failed)
+		{
+			size_t age = emsh_hist_search(&self->hist, self->search.age, self->search.query, self->search.len);
+			if (age != 0)
+			{
+				self->search.age = age;
+			}
+			self->search.failed = (age == 0);
+		}
+	}
+	emsh_disp_search(self);
+}
+
+static void emsh_search_erase(emsh_t *self)
+{
+	if (self->search.len != 0)
+	{
+		--self->search.len;
+		self->search.age = 0;
+		self->search.failed = false;
+		if (self->search.len != 0)
+		{
+			self->search.age = emsh_hist_search(&self->hist, 1, self->search.query, self->search.len);
+			self->search.failed = (self->search.age == 0);
+		}
+	}
+	emsh_disp_search(self);
+}
+
+/// ends the search; the match becomes the line
+static void emsh_search_accept(emsh_t *self)
+{
+	self->search.active = false;
+
+	if (self->search.age != 0)
+	{
+		size_t len;
+		const char *str;
+
+		self->hist.pos = self->search.age;
+#if EMSH_ENABLE_PREFIX_SEARCH
+		self->prefix_len = 0; // browse around the match
+#endif
+#if EMSH_ENABLE_SHARED_HIST
+		self->shared.pos = 0;
+#endif
+		str = emsh_hist_current(&self->hist, &len);
+		memcpy(self->line, str, len);
+		self->line[len] = '\0';
+		emsh_load_line(self);
+	}
+	emsh_disp_line(self);
+}
+
+/// ends the search leaving the line as it was
+static void emsh_search_cancel(emsh_t *self)
+{
+	self->search.active = false;
+	emsh_disp_line(self);
+}
+
+/// handles c during a search; false if c ends the search and has to be handled as usual
+static bool emsh_search_task(emsh_t *self, int c)
+{
+	switch (c)
+	{
+	case ASCII_CNTRL('R'):
+		emsh_do_search(self);
+		return true;
+	case ASCII_CNTRL('G'):
+		emsh_search_cancel(self);
+		return true;
+	case ASCII_C_BS:
+	case ASCII_C_DEL:
+		emsh_search_erase(self);
+		return true;
+	default:
+		if (ascii_isprint(c))
+		{
+			emsh_search_insert(self, (char)c);
+			return true;
+		}
+		emsh_search_accept(self);
+		return false;
+	}
+}
+#endif
+
+static bool emsh_searching(const emsh_t *self)
+{
+#if EMSH_ENABLE_SEARCH
+	return self->search.active;
+#else
+	(void)self;
+	return false;
+#endif
+}
+
+#if EMSH_ENABLE_COMPLETION
+void emsh_complete_add(emsh_completion_t *c, const char *str, size_t len, size_t n)
+{
+	if (n == 0 || len < c->len || memcmp(str, c->word, c->len) != 0)
+	{
+		return;
+	}
+
+	if (c->list)
+	{
+		emsh_iov_t iov[] = {
+			{.base = str, .len = len},
+			EMSH_IOV_STR("  "),
+		};
+		emsh_write_iov(c->sh, iov, sizeof(iov)/sizeof(*iov));
+		return;
+	}
+
+	str += c->len;
+	len -= c->len;
+	if (c->n == 0)
+	{
+		c->whole = (n == 1 && len <= EMSH_MAX_COMPLETION_SIZE);
+		c->ext_len = len <= EMSH_MAX_COMPLETION_SIZE ? len : EMSH_MAX_COMPLETION_SIZE;
+		memcpy(c->ext, str, c->ext_len);
+	}
+	else
+	{
+		size_t i = 0;
+		while (i < c->ext_len && i < len && c->ext[i] == str[i]) ++i;
+		c->ext_len = i;
+		c->whole = false;
+	}
+	c->n += n;
+}
+
+/// completes the word before the cursor, or lists the candidates after a Tab which couldn't
+static void emsh_do_complete(emsh_t *self)
+{
+	size_t pos = emsh_buf_pos(&self->buf);
+	const char *data = emsh_buf_data(&self->buf);
+	emsh_completion_t c;
+
+	if (self->ops.complete == NULL)
+	{
+		return;
+	}
+
+	// the words before the one being completed
+	c.index = 0;
+	for (size_t i = 0; i < pos; )
+	{
+		const char *space;
+
+		while (i < pos && data[i] == ' ') ++i;
+		space = memchr(&data[i], ' ', pos - i);
+		if (space == NULL)
+		{
+			break; // the word being completed
+		}
+		if (c.index == emsh_max_n_args(self) - 1)
+		{
+			return; // no room for one more argument
+		}
+		self->cmd.args[c.index].base = &data[i]; // not in use while editing
+		self->cmd.args[c.index].len = (size_t)(space - &data[i]);
+		++c.index;
+		i = (size_t)(space - data);
+	}
+
+	c.args = self->cmd.args;
+	c.len = 0;
+	while (c.len < pos && data[pos - c.len - 1] != ' ') ++c.len;
+	c.word = &data[pos - c.len];
+	c.list = self->tab_pending;
+	c.sh = self;
+	c.n = 0;
+	c.ext_len = 0;
+	c.whole = false;
+
+	if (c.list)
+	{
+		emsh_write_newline(self);
+		self->ops.complete(self->cookie, &c);
+		emsh_write_newline(self);
+		emsh_disp_line(self);
+		return;
+	}
+
+	self->ops.complete(self->cookie, &c);
+	if (c.whole && c.n == 1)
+	{
+		c.ext[c.ext_len++] = ' ';
+	}
+	emsh_do_insert_n(self, c.ext, c.ext_len);
+	self->tab_pending = (c.n > 1 && c.ext_len == 0);
+}
+#endif
+
+#if EMSH_ENABLE_BRACKETED_PASTE
+static const char emsh_paste_end[] = CTLSEQ_S_CSI "201~";
+
+static void emsh_paste_begin(emsh_t *self)
+{
+	self->paste.active = true;
+	self->paste.at_prompt = true;
+	self->paste.matched = 0;
+	self->paste.dropping = false;
+}
+
+/// inserts pasted characters without showing them, as the line is echoed once complete
+static void emsh_paste_insert_n(emsh_t *self, const char *str, size_t len)
+{
+	size_t room = self->paste.dropping ? 0 : emsh_buf_capacity(&self->buf) - emsh_buf_size(&self->buf);
+	if (len > room)
+	{
+		len = room;
+	}
+
+	if (len != 0)
+	{
+		emsh_buf_insert_n(&self->buf, str, len);
+	}
+}
+
+/// echoes the pasted line and runs it, without a prompt until the paste ends
+static void emsh_paste_commit(emsh_t *self)
+{
+	size_t size = emsh_buf_size(&self->buf);
+	emsh_iov_t iov[1 + 2 + 1 + 1];
+	emsh_iov_t prompt = EMSH_IOV_STR(ASCII_S_CR EMSH_S_PROMPT);
+	emsh_iov_t el = EMSH_IOV_STR(CTLSEQ_S_CSI CTLSEQ_S_EL);
+	emsh_iov_t newline = EMSH_IOV_STR(EMSH_S_NEWLINE);
+	size_t n = 0;
+
+	if (self->paste.at_prompt)
+	{
+		// the first line goes over the one being edited
+		iov[n++] = prompt;
+	}
+	n += emsh_buf_iov(&self->buf, 0, size, &iov[n]);
+	if (self->paste.at_prompt)
+	{
+		iov[n++] = el;
+	}
+	iov[n++] = newline;
+	emsh_write_iov(self, iov, n);
+	self->paste.at_prompt = false;
+
+	emsh_commit(self, EMSH_ENABLE_PASTE_HIST);
+	self->paste.dropping = !self->running;
+}
+
+static void emsh_paste_task(emsh_t *self, int c)
+{
+	if (c == (unsigned char)emsh_paste_end[self->paste.matched])
+	{
+		if (++self->paste.matched == sizeof(emsh_paste_end) - 1)
+		{
+			self->paste.active = false;
+			emsh_disp_line(self);
+		}
+		return;
+	}
+
+	// not the end marker: what followed ESC was pasted text
+	if (self->paste.matched > 1)
+	{
+		emsh_paste_insert_n(self, &emsh_paste_end[1], self->paste.matched - 1);
+	}
+	self->paste.matched = 0;
+
+	if (c == (unsigned char)emsh_paste_end[0])
+	{
+		self->paste.matched = 1;
+	}
+	else if (c == ASCII_C_LF && !self->paste.dropping)
+	{
+		emsh_paste_commit(self);
+	}
+	else if (ascii_isprint(c))
+	{
+		char ch = (char)c;
+		emsh_paste_insert_n(self, &ch, 1);
+	}
+	// the other control characters, CR included, are dropped
+}
+
+#endif
+
+static bool emsh_pasting(const emsh_t *self)
+{
+#if EMSH_ENABLE_BRACKETED_PASTE
+	return self->paste.active;
+#else
+	(void)self;
+	return false;
+#endif
+}
+
+/// cursor forward
+static void emsh_do_cuf(emsh_t *self)
+{
+	if (emsh_buf_pos(&self->buf) < emsh_buf_size(&self->buf))
+	{
+		emsh_cur_move_forward(self);
+	}
+}
+
+/// cursor back
+static void emsh_do_cub(emsh_t *self)
 {
 	if (emsh_buf_pos(&self->buf) > 0)
 	{
-		emsh_do_cub(self);
-		emsh_do_erase(self);
+		emsh_cur_move_backward(self);
 	}
 }
 
-/// start of line
-static void emsh_do_sol(emsh_t *self)
+/// start of the word before the cursor
+static void emsh_do_word_back(emsh_t *self)
 {
-	emsh_cur_set_pos(self, 0);
+	size_t pos = emsh_buf_pos(&self->buf);
+
+	while (pos > 0 && emsh_buf_at(&self->buf, pos - 1) == ' ') --pos;
+	while (pos > 0 && emsh_buf_at(&self->buf, pos - 1) != ' ') --pos;
+	emsh_cur_set_pos(self, pos);
 }
 
-/// end of line
-static void emsh_do_eol(emsh_t *self)
+/// end of the word after the cursor
+static void emsh_do_word_fwd(emsh_t *self)
 {
-	emsh_cur_set_pos(self, emsh_buf_size(&self->buf));
+	size_t size = emsh_buf_size(&self->buf);
+	size_t pos = emsh_buf_pos(&self->buf);
+
+	while (pos < size && emsh_buf_at(&self->buf, pos) == ' ') ++pos;
+	while (pos < size && emsh_buf_at(&self->buf, pos) != ' ') ++pos;
+	emsh_cur_set_pos(self, pos);
+}
+
+/// backspace
+static void emsh_do_bs(emsh_t *self)
+{
+	if (emsh_buf_pos(&self->buf) > 0)
+	{
+		emsh_do_cub(self);
+		emsh_do_erase(self);
+	}
 }
 
 /*
@@ -513,31 +2415,254 @@ static void emsh_do_eol(emsh_t *self)
 
 void emsh_init(emsh_t *self, const emsh_conf_t *conf)
 {
-	assert(conf->ops.write_char != NULL);
 	assert(conf->ops.write_strn != NULL);
-	assert(conf->ops.exec != NULL);
-	assert(conf->blocks != NULL);
+	assert(conf->ops.exec != NULL || conf->ops.exec_spans != NULL);
+	assert(conf->hist_mem != NULL);
 
 	self->cookie = conf->cookie;
 	self->ops = conf->ops;
 
-	emsh_hist_init(&self->hist, conf->blocks, EMSH_MAX_HIST_SIZE);
-	emsh_buf_init(&self->buf, emsh_hist_current(&self->hist), EMSH_MAX_LINE_SIZE);
+#if EMSH_ENABLE_OUTPUT_BUFFER
+	if (conf->out_buf != NULL && conf->out_buf_size != 0)
+	{
+		bytearray_init(&self->out.buf, conf->out_buf_size, (bytearray_datum_t *)conf->out_buf);
+	}
+	else
+	{
+		bytearray_t none = BYTEARRAY_INITIALIZER(0, NULL);
+		self->out.buf = none;
+	}
+#endif
+	self->out.dirty = false;
+
+#if EMSH_ENABLE_STATS
+	memset(&self->stats, 0, sizeof(self->stats));
+#endif
+
+#if EMSH_ENABLE_RUNTIME_SIZE
+	assert(conf->line_mem != NULL);
+	assert(conf->max_line_size != 0);
+	assert(conf->argv != NULL);
+	assert(conf->args != NULL);
+	assert(conf->max_n_args > 0);
+
+	self->max_line_size = conf->max_line_size;
+	self->line = &conf->line_mem[0];
+	self->draft = &conf->line_mem[conf->max_line_size + 1];
+#if EMSH_ENABLE_SHARED_HIST
+	self->shared.line = &conf->line_mem[2 * (conf->max_line_size + 1)];
+#endif
+	self->cmd.argv = conf->argv;
+	self->cmd.args = conf->args;
+	self->cmd.max_n_args = conf->max_n_args;
+	assert(conf->hist_ring != NULL);
+	assert(conf->max_hist_size != 0);
+
+	self->hist.ring = conf->hist_ring;
+#if EMSH_ENABLE_PREFIX_SEARCH
+	assert(conf->hist_sorted != NULL);
+	self->hist.sorted = conf->hist_sorted;
+#endif
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+	assert(conf->hist_hash != NULL);
+	self->hist.hash = conf->hist_hash;
+#endif
+#if EMSH_ENABLE_SEARCH_INDEX
+	assert(conf->hist_trigrams != NULL);
+	assert(conf->hist_chain != NULL);
+	self->hist.trigrams = conf->hist_trigrams;
+	self->hist.chain = conf->hist_chain;
+#endif
+	self->hist.capacity = conf->max_hist_size;
+	emsh_hist_init(&self->hist, conf->hist_mem, conf->hist_mem_size);
+#else
+	emsh_hist_init(&self->hist, conf->hist_mem, EMSH_HIST_MEM_SIZE);
+#endif
+	// an entry as long as the line has to fit
+	assert(emsh_max_line_size(self) <= 0xFFFF);
+	assert(self->hist.mem_size >= EMSH_HIST_ENTRY_SIZE(emsh_max_line_size(self)));
+
+	self->line[0] = '\0';
+	self->draft[0] = '\0';
+#if EMSH_ENABLE_PREFIX_SEARCH
+	self->prefix_len = 0;
+#endif
+#if EMSH_ENABLE_COMPLETION
+	self->tab_pending = false;
+#endif
+#if EMSH_ENABLE_SHARED_HIST
+	// a shared entry as long as the line has to fit
+	assert(conf->shared_hist == NULL || conf->shared_hist->max_line_size >= emsh_max_line_size(self));
+	self->shared.hist = conf->shared_hist;
+	self->shared.base = 0;
+	self->shared.pos = 0;
+	self->shared.len = 0;
+#endif
+	emsh_load_line(self);
+
+	self->running = false;
 
 	self->ctlseq.st = CTLSEQ_ST_INIT;
+	self->ctlseq.priv_byte = 0x00;
 	self->ctlseq.interm_byte = 0x00;
+	self->ctlseq.n_params = 0;
+	self->term_size_pending = false;
+	self->esc_time = 0;
+	self->esc_timeout_ms = conf->esc_timeout_ms != 0 ? conf->esc_timeout_ms : EMSH_ESC_TIMEOUT_MS;
+	assert(self->esc_timeout_ms <= INT32_MAX);
+
+#if EMSH_ENABLE_BRACKETED_PASTE
+	self->paste.active = false;
+	self->paste.at_prompt = false;
+	self->paste.matched = 0;
+	self->paste.dropping = false;
+#endif
+
+#if EMSH_ENABLE_SEARCH
+	self->search.active = false;
+#endif
 }
 
 void emsh_start(emsh_t *self)
 {
 	self->running = true;
+#if EMSH_ENABLE_BRACKETED_PASTE
+	emsh_write_str(self, EMSH_S_BRACKETED_PASTE_ON);
+#endif
 	emsh_write_prompt(self);
+	emsh_out_flush(self);
 }
 
-void emsh_task(emsh_t *self, int c)
+void emsh_query_term_size(emsh_t *self)
 {
-	int psep;
-	ctlseq_ev_t ev = ctlseq_sm(&self->ctlseq.st, c, &psep);
+	// the cursor stops at the bottom right corner, whose position is reported
+	emsh_write_str(self, ASCII_S_ESC "7" CTLSEQ_S_CSI "999;999" CTLSEQ_S_CUP CTLSEQ_S_CSI "6" CTLSEQ_S_DSR ASCII_S_ESC "8");
+	emsh_out_flush(self);
+	self->term_size_pending = true;
+}
+
+/*
+ * The numeric parameters of a control sequence are decoded as its bytes
+ * arrive: digits accumulate into the current parameter and each end of a
+ * parameter sub-string (psep) starts the next one.
+ */
+
+static void emsh_csi_param(emsh_t *self, int c)
+{
+	size_t i = self->ctlseq.n_params;
+
+	if (i >= EMSH_MAX_CSI_PARAMS)
+	{
+		// dropped
+	}
+	else if (ascii_isdigit(c))
+	{
+		uint_fast32_t val = self->ctlseq.params[i] * 10u + (uint_fast32_t)(c - '0');
+		self->ctlseq.params[i] = val < UINT16_MAX ? (uint16_t)val : UINT16_MAX;
+	}
+	else if (c != CTLSEQ_K_PSEP)
+	{
+		self->ctlseq.n_params = EMSH_MAX_CSI_PARAMS + 1; // not a number
+	}
+}
+
+static void emsh_csi_psep(emsh_t *self)
+{
+	if (self->ctlseq.n_params <= EMSH_MAX_CSI_PARAMS)
+	{
+		++self->ctlseq.n_params;
+	}
+	if (self->ctlseq.n_params < EMSH_MAX_CSI_PARAMS)
+	{
+		self->ctlseq.params[self->ctlseq.n_params] = 0;
+	}
+}
+
+/// dispatches a control sequence without private parameters or intermediate bytes
+static void emsh_do_csi(emsh_t *self, int final, const uint16_t *params, size_t n_params)
+{
+	// xterm modifiers: 1 + (1 Shift | 2 Alt | 4 Ctrl)
+	bool word = n_params == 2 && params[1] >= 2 && ((params[1] - 1) & 0x06) != 0;
+
+	switch (final)
+	{
+	case CTLSEQ_C_CUU:
+		emsh_do_cuu(self);
+		break;
+	case CTLSEQ_C_CUD:
+		emsh_do_cud(self);
+		break;
+	case CTLSEQ_C_CUF:
+		if (word)
+		{
+			emsh_do_word_fwd(self);
+		}
+		else
+		{
+			emsh_do_cuf(self);
+		}
+		break;
+	case CTLSEQ_C_CUB:
+		if (word)
+		{
+			emsh_do_word_back(self);
+		}
+		else
+		{
+			emsh_do_cub(self);
+		}
+		break;
+	case CTLSEQ_C_CPR:
+		if (self->term_size_pending && n_params == 2)
+		{
+			self->term_size_pending = false;
+			if (self->ops.term_size != NULL)
+			{
+				self->ops.term_size(self->cookie, params[0], params[1]);
+			}
+		}
+		break;
+#if 1
+	case 0x7E:
+		if (n_params != 1)
+		{
+			break;
+		}
+		switch (params[0])
+		{
+		case 1:
+			emsh_do_sol(self);
+			break;
+		case 2:
+			// overwrite-mode
+			break;
+		case 3:
+			emsh_do_erase(self);
+			break;
+		case 4:
+			emsh_do_eol(self);
+			break;
+#if EMSH_ENABLE_BRACKETED_PASTE
+		case 200:
+			emsh_paste_begin(self);
+			break;
+#endif
+		}
+		break;
+#endif
+	}
+}
+
+/// dispatches a byte the parser has already taken to self->ctlseq.st with the event ev
+static void emsh_task_ev(emsh_t *self, int c, ctlseq_ev_t ev, int psep)
+{
+#if EMSH_ENABLE_COMPLETION
+	if (c != ASCII_C_HT)
+	{
+		self->tab_pending = false;
+	}
+#endif
+
 	if (self->ctlseq.st == CTLSEQ_ST_INIT)
 	{
 		switch (c)
@@ -574,6 +2699,16 @@ void emsh_task(emsh_t *self, int c)
 		case ASCII_CNTRL('P'):
 			emsh_do_cuu(self);
 			break;
+#endif
+#if EMSH_ENABLE_SEARCH
+		case ASCII_CNTRL('R'):
+			emsh_do_search(self);
+			break;
+#endif
+#if EMSH_ENABLE_COMPLETION
+		case ASCII_C_HT:
+			emsh_do_complete(self);
+			break;
 #endif
 		default:
 			if (ascii_isprint(c))
@@ -584,12 +2719,17 @@ void emsh_task(emsh_t *self, int c)
 	}
 	else
 	{
+		if (psep)
+		{
+			emsh_csi_psep(self);
+		}
+
 		switch (ev)
 		{
 		case CTLSEQ_EV_NONE:
 			if (self->ctlseq.st == CTLSEQ_ST_PARAM)
 			{
-				self->ctlseq.param_byte = 0xFF; // more than one parameter bytes
+				emsh_csi_param(self, c);
 			}
 			else if (self->ctlseq.st == CTLSEQ_ST_INTERM)
 			{
@@ -598,13 +2738,26 @@ void emsh_task(emsh_t *self, int c)
 			break;
 		case CTLSEQ_EV_ESC:
 			// init
-			self->ctlseq.param_byte = 0x00; // no parameter byte
+			self->ctlseq.priv_byte = 0x00; // no private parameter string
 			self->ctlseq.interm_byte = 0x00; // no intermediate byte
+			self->ctlseq.n_params = 0;
+			self->ctlseq.params[0] = 0;
+			if (self->ops.now_ms != NULL)
+			{
+				self->esc_time = self->ops.now_ms(self->cookie);
+			}
 			break;
 		case CTLSEQ_EV_CSI:
 			break;
 		case CTLSEQ_EV_PARAM:
-			self->ctlseq.param_byte = c; // the first parameter byte
+			if (ctlseq_is_priv_param_1st_byte(c))
+			{
+				self->ctlseq.priv_byte = c;
+			}
+			else
+			{
+				emsh_csi_param(self, c);
+			}
 			break;
 		case CTLSEQ_EV_INTERM:
 			self->ctlseq.interm_byte = c; // the first intermediate byte
@@ -613,39 +2766,9 @@ void emsh_task(emsh_t *self, int c)
 			switch (self->ctlseq.interm_byte)
 			{
 			case 0x00:
-				switch (c)
+				if (self->ctlseq.priv_byte == 0x00)
 				{
-				case CTLSEQ_C_CUU:
-					emsh_do_cuu(self);
-					break;
-				case CTLSEQ_C_CUD:
-					emsh_do_cud(self);
-					break;
-				case CTLSEQ_C_CUF:
-					emsh_do_cuf(self);
-					break;
-				case CTLSEQ_C_CUB:
-					emsh_do_cub(self);
-					break;
-#if 1
-				case 0x7E:
-					switch (self->ctlseq.param_byte)
-					{
-					case 0x31:
-						emsh_do_sol(self);
-						break;
-					case 0x32:
-						// overwrite-mode
-						break;
-					case 0x33:
-						emsh_do_erase(self);
-						break;
-					case 0x34:
-						emsh_do_eol(self);
-						break;
-					}
-					break;
-#endif
+					emsh_do_csi(self, c, self->ctlseq.params, self->ctlseq.n_params);
 				}
 				break;
 			case CTLSEQ_K_MAP_1:
@@ -659,23 +2782,198 @@ void emsh_task(emsh_t *self, int c)
 	}
 }
 
+static void emsh_task_1(emsh_t *self, int c)
+{
+#if EMSH_ENABLE_BRACKETED_PASTE
+	if (self->paste.active)
+	{
+		emsh_paste_task(self, c);
+		return;
+	}
+#endif
+
+#if EMSH_ENABLE_SEARCH
+	if (self->search.active && emsh_search_task(self, c))
+	{
+		return;
+	}
+#endif
+
+	int psep;
+	ctlseq_ev_t ev = ctlseq_sm(&self->ctlseq.st, c, &psep);
+	emsh_task_ev(self, c, ev, psep);
+}
+
+/// input taken a byte at a time (emsh_task_1()) instead of in runs
+static bool emsh_task_bytewise(const emsh_t *self)
+{
+	return emsh_searching(self) || emsh_pasting(self) || !self->running;
+}
+
+/**
+ * Takes buf[0, len) outside of search and paste: ctlseq_sm_n() finds the
+ * bytes of control sequences, the plain text between them goes in runs.
+ * Returns the bytes taken, fewer than len once a byte has switched the
+ * shell to taking input a byte at a time.
+ */
+static size_t emsh_task_text(emsh_t *self, const char *buf, size_t len)
+{
+	ctlseq_event_t events[EMSH_TASK_N_EVENTS];
+	ctlseq_st_t st = self->ctlseq.st;
+	size_t n_events = ctlseq_sm_n(&st, buf, len, events, EMSH_TASK_N_EVENTS);
+	size_t end = n_events == EMSH_TASK_N_EVENTS ? events[n_events - 1].pos + 1 : len;
+	size_t i = 0;
+
+	for (size_t k = 0; i < end; ++k)
+	{
+		size_t next = k < n_events ? events[k].pos : end;
+
+		// plain text, which leaves the parser at CTLSEQ_ST_INIT
+		while (i < next)
+		{
+			self->ctlseq.st = CTLSEQ_ST_INIT;
+			if (ascii_isprint((unsigned char)buf[i]))
+			{
+				size_t n = ascii_span_print(&buf[i], next - i);
+
+#if EMSH_ENABLE_COMPLETION
+				self->tab_pending = false;
+#endif
+				emsh_do_insert_n(self, &buf[i], n);
+				i += n;
+			}
+			else
+			{
+				emsh_task_ev(self, (unsigned char)buf[i], CTLSEQ_EV_NONE, 0);
+				++i;
+				if (emsh_task_bytewise(self))
+				{
+					return i;
+				}
+			}
+		}
+
+		if (k < n_events)
+		{
+			self->ctlseq.st = events[k].st;
+			emsh_task_ev(self, (unsigned char)buf[i], events[k].ev, events[k].psep);
+			++i;
+			if (emsh_task_bytewise(self))
+			{
+				return i;
+			}
+		}
+	}
+	self->ctlseq.st = st;
+
+	return i;
+}
+
+/// takes the pending ESC alone once the rest of a control sequence is overdue; returns the milliseconds left, -1 if none is pending
+static int32_t emsh_esc_expire(emsh_t *self)
+{
+	if (self->ops.now_ms == NULL || self->ctlseq.st != CTLSEQ_ST_ESC)
+	{
+		return -1;
+	}
+
+	uint32_t elapsed = self->ops.now_ms(self->cookie) - self->esc_time;
+	if (elapsed < self->esc_timeout_ms)
+	{
+		return (int32_t)(self->esc_timeout_ms - elapsed);
+	}
+	self->ctlseq.st = CTLSEQ_ST_INIT; // a lone ESC, which isn't bound to anything
+	return -1;
+}
+
+int32_t emsh_poll(emsh_t *self)
+{
+	return emsh_esc_expire(self);
+}
+
+void emsh_task(emsh_t *self, int c)
+{
+	// input delivered together is parsed together, a late one after the timeout
+	(void)emsh_esc_expire(self);
+	emsh_task_1(self, c);
+	emsh_out_flush(self);
+}
+
+size_t emsh_task_n(emsh_t *self, const char *buf, size_t len)
+{
+	size_t i = 0;
+
+	(void)emsh_esc_expire(self);
+
+	while (i < len && self->running)
+	{
+#if EMSH_ENABLE_BRACKETED_PASTE
+		if (self->paste.active && self->paste.matched == 0 && ascii_isprint((unsigned char)buf[i]))
+		{
+			// a run of pasted characters, shown when the line ends
+			size_t n = ascii_span_print(&buf[i], len - i);
+
+			emsh_paste_insert_n(self, &buf[i], n);
+			i += n;
+			continue;
+		}
+#endif
+		if (!emsh_task_bytewise(self))
+		{
+			i += emsh_task_text(self, &buf[i], len - i);
+		}
+		else
+		{
+			emsh_task_1(self, (unsigned char)buf[i]);
+			++i;
+		}
+	}
+	emsh_out_flush(self);
+
+	return i;
+}
+
 void emsh_stop(emsh_t *self)
 {
+#if EMSH_ENABLE_BRACKETED_PASTE
+	if (self->running)
+	{
+		emsh_write_str(self, EMSH_S_BRACKETED_PASTE_OFF);
+		emsh_out_flush(self);
+	}
+#endif
 	self->running = false;
 }
 
+bool emsh_hist_push(emsh_t *self, const char *line, size_t len)
+{
+	if (len > emsh_max_line_size(self))
+	{
+		return false;
+	}
+
+	emsh_hist_rewind(&self->hist);
+	emsh_hist_commit(&self->hist, line, len);
+	return true;
+}
+
 #if EMSH_ENABLE_GETOPT
 static void _emsh_write_getopt_error(emsh_t *self, const char *name, const char *msg, size_t msglen)
 {
 #if 1
 	if (emsh_opterr)
 	{
-		emsh_write_str(self, name);
-		emsh_write_str(self, ": ");
-		emsh_write_strn(self, msg, msglen);
-		emsh_write_str(self, " -- ");
-		emsh_write_char(self, emsh_optopt);
-		emsh_write_newline(self);
+		char optopt = (char)emsh_optopt;
+		emsh_iov_t iov[] = {
+			{.base = name, .len = strlen(name)},
+			EMSH_IOV_STR(": "),
+			{.base = msg, .len = msglen},
+			EMSH_IOV_STR(" -- "),
+			{.base = &optopt, .len = 1},
+			EMSH_IOV_STR(EMSH_S_NEWLINE),
+		};
+		emsh_write_iov(self, iov, sizeof(iov)/sizeof(*iov));
+		emsh_out_flush(self); // called from within ops.exec
 	}
 #else
 	(void)self;
@@ -9,8 +9,8 @@
 
 #include "ascii.h"
 #include "ctlseq.h"
-#include "list.h"
 #include "bytearray.h"
+#include "gapbuf.h"
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -38,43 +38,253 @@ extern "C" {
   #define EMSH_S_NEWLINE ASCII_S_LF
 #endif
 
+#if !defined(EMSH_ESC_TIMEOUT_MS)
+  #define EMSH_ESC_TIMEOUT_MS 50 ///< a lone ESC is resolved this long after it, when ops.now_ms is set
+#endif
+
+#if !defined(EMSH_MAX_CSI_PARAMS)
+  #define EMSH_MAX_CSI_PARAMS 2 ///< numeric parameters of a control sequence decoded for its dispatch, at least 2
+#endif
+
+#if !defined(EMSH_TASK_N_EVENTS)
+  #define EMSH_TASK_N_EVENTS 8 ///< control sequence bytes emsh_task_n() locates per scan of its input, kept on the stack
+#endif
+
 #if !defined(EMSH_ENABLE_GETOPT)
   #define EMSH_ENABLE_GETOPT 1
 #endif
 
+#if !defined(EMSH_ENABLE_HIST_EXPANSION)
+  #define EMSH_ENABLE_HIST_EXPANSION 1 ///< !!, !N and !-N
+#endif
+
+#if !defined(EMSH_ENABLE_SEARCH)
+  #define EMSH_ENABLE_SEARCH 1 ///< Ctrl-R reverse incremental search
+#endif
+
+#if !defined(EMSH_MAX_SEARCH_SIZE)
+  #define EMSH_MAX_SEARCH_SIZE 32
+#endif
+
+#if !defined(EMSH_ENABLE_SEARCH_INDEX)
+  #define EMSH_ENABLE_SEARCH_INDEX 0 ///< Ctrl-R looks up a trigram index instead of scanning the entries, for large histories
+#endif
+
+#if !defined(EMSH_SEARCH_INDEX_SIZE)
+  #define EMSH_SEARCH_INDEX_SIZE 1024 ///< trigram buckets of the search index, a power of 2
+#endif
+
+#if !defined(EMSH_ENABLE_PREFIX_SEARCH)
+  #define EMSH_ENABLE_PREFIX_SEARCH 1 ///< Up/Down step through the entries starting with the line typed so far
+#endif
+
+#define EMSH_HIST_DEDUP_NONE 0
+#define EMSH_HIST_DEDUP_CONSECUTIVE 1 ///< a line equal to the newest entry isn't added again
+#define EMSH_HIST_DEDUP_MOVE 2 ///< an older entry equal to the line is removed
+
+#if !defined(EMSH_HIST_DEDUP)
+  #define EMSH_HIST_DEDUP EMSH_HIST_DEDUP_NONE
+#endif
+
+#if !defined(EMSH_ENABLE_COMPLETION)
+  #define EMSH_ENABLE_COMPLETION 1 ///< Tab completes the word before the cursor through ops.complete
+#endif
+
+#if !defined(EMSH_MAX_COMPLETION_SIZE)
+  #define EMSH_MAX_COMPLETION_SIZE 32 ///< characters added by one Tab
+#endif
+
+#if !defined(EMSH_ENABLE_SHARED_HIST)
+  #define EMSH_ENABLE_SHARED_HIST 0 ///< Up/Down browse a history shared by sessions running on several threads (needs C11 atomics)
+#endif
+
+#if !defined(EMSH_ENABLE_BRACKETED_PASTE)
+  #define EMSH_ENABLE_BRACKETED_PASTE 0 ///< a pasted script runs line by line, each line echoed once; the terminal is in bracketed paste mode from emsh_start() to emsh_stop()
+#endif
+
+#if !defined(EMSH_ENABLE_PASTE_HIST)
+  #define EMSH_ENABLE_PASTE_HIST 1 ///< the pasted lines are added to the history
+#endif
+
+#if !defined(EMSH_ENABLE_RUNTIME_SIZE)
+  #define EMSH_ENABLE_RUNTIME_SIZE 0 ///< take the sizes and their memory from emsh_conf_t instead of EMSH_MAX_*
+#endif
+
+#if !defined(EMSH_ENABLE_OUTPUT_BUFFER)
+  #define EMSH_ENABLE_OUTPUT_BUFFER 1
+#endif
+
+#if !defined(EMSH_ENABLE_DIFF_REDRAW)
+  #define EMSH_ENABLE_DIFF_REDRAW 1
+#endif
+
+#if !defined(EMSH_ENABLE_ICH_DCH)
+  #define EMSH_ENABLE_ICH_DCH 0 ///< edit mid-line with ICH/DCH; the terminal has to support them
+#endif
+
+#if !defined(EMSH_ENABLE_STATS)
+  #define EMSH_ENABLE_STATS 1
+#endif
+
+#if EMSH_ENABLE_SHARED_HIST
+#include <stdatomic.h>
+#endif
+
+#if EMSH_ENABLE_BRACKETED_PASTE
+#define EMSH_S_BRACKETED_PASTE_ON CTLSEQ_S_CSI "?2004" CTLSEQ_S_SM ///< written by emsh_start()
+#define EMSH_S_BRACKETED_PASTE_OFF CTLSEQ_S_CSI "?2004" CTLSEQ_S_RM ///< written by emsh_stop()
+#endif
+
 ///@internal
 typedef struct emsh_buf
 {
-	bytearray_t array;
+	gapbuf_t gap;
 	size_t pos;
 } emsh_buf_t;
 
+/// the hash table of the history is kept at most half full
+#define EMSH_HIST_HASH_SIZE(_max_hist_size) (2 * (_max_hist_size))
+
 ///@internal
-typedef struct emsh_block
+typedef struct emsh_hist_slot
 {
-	list_node_t node;
-	char mem[EMSH_MAX_LINE_SIZE+1];
-} emsh_block_t;
+	size_t off;
+#if EMSH_ENABLE_SEARCH && !EMSH_ENABLE_SEARCH_INDEX
+	uint64_t sig; ///< trigrams of the entry (see emsh.c)
+#endif
+} emsh_hist_slot_t;
+
+#if EMSH_ENABLE_SEARCH_INDEX
+///@internal
+/// the occurrences of the trigrams hashed to a bucket, chained from the newest one (see emsh.c)
+typedef struct emsh_hist_trigram
+{
+	size_t newest; ///< arena offset, SIZE_MAX for none
+	size_t count;
+} emsh_hist_trigram_t;
+#endif
+
+/// bytes taken by a history entry of len characters in the arena
+#define EMSH_HIST_ENTRY_SIZE(_len) ((_len) + 2)
+
+#if !EMSH_ENABLE_RUNTIME_SIZE
+#if !defined(EMSH_HIST_MEM_SIZE)
+  #define EMSH_HIST_MEM_SIZE (EMSH_MAX_HIST_SIZE * EMSH_HIST_ENTRY_SIZE(EMSH_MAX_LINE_SIZE)) ///< holds at least EMSH_MAX_HIST_SIZE entries
+#endif
+#endif
 
 ///@internal
+/// entries packed back to back in a circular arena, indexed by a ring of offsets (see emsh.c)
 typedef struct emsh_hist
 {
+	unsigned char *mem;
+	size_t mem_size;
+	size_t head; ///< the oldest entry
+	size_t tail; ///< past the newest entry
+	size_t wrap_end; ///< past the last entry before offset 0 when wrapped
+	bool wrapped;
+#if EMSH_ENABLE_RUNTIME_SIZE
+	emsh_hist_slot_t *ring; ///< capacity elements
+#if EMSH_ENABLE_PREFIX_SEARCH
+	size_t *sorted; ///< capacity elements
+#endif
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+	size_t *hash; ///< EMSH_HIST_HASH_SIZE(capacity) elements
+#endif
+#if EMSH_ENABLE_SEARCH_INDEX
+	emsh_hist_trigram_t *trigrams; ///< EMSH_SEARCH_INDEX_SIZE elements
+	size_t *chain; ///< mem_size elements
+#endif
 	size_t capacity;
-	list_t free_list;
-	list_t list;
-	size_t size;
-	unsigned int pos;
-	list_node_t *cur;
+#else
+	emsh_hist_slot_t ring[EMSH_MAX_HIST_SIZE];
+#if EMSH_ENABLE_PREFIX_SEARCH
+	size_t sorted[EMSH_MAX_HIST_SIZE]; ///< offsets of the entries in lexicographic order
+#endif
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+	size_t hash[EMSH_HIST_HASH_SIZE(EMSH_MAX_HIST_SIZE)]; ///< open addressing table of the offsets plus 1 (0 for none)
+#endif
+#if EMSH_ENABLE_SEARCH_INDEX
+	emsh_hist_trigram_t trigrams[EMSH_SEARCH_INDEX_SIZE];
+	size_t chain[EMSH_HIST_MEM_SIZE]; ///< the offset of the previous occurrence of the trigram bucket at each offset
+#endif
+#endif
+	size_t first; ///< ring index of the oldest entry
+	size_t size; ///< entries in the ring
+	size_t pos; ///< age of the entry being edited (0 is the draft)
 } emsh_hist_t;
 
+#if EMSH_ENABLE_SHARED_HIST
+///@internal
+typedef struct emsh_shared_hist_slot
+{
+	atomic_size_t seq; ///< 2 * ticket + 1 while being written, 2 * ticket + 2 once complete
+	atomic_size_t len;
+} emsh_shared_hist_slot_t;
+
+/// the newest n_slots entries committed by any session, appended without locks (see emsh.c)
+typedef struct emsh_shared_hist
+{
+	atomic_size_t tail; ///< ticket of the next entry
+	emsh_shared_hist_slot_t *slots;
+	atomic_uchar *mem; ///< max_line_size bytes per slot
+	size_t n_slots;
+	size_t max_line_size;
+} emsh_shared_hist_t;
+
+#define EMSH_SHARED_HIST_MEM_SIZE(_n_slots, _max_line_size) ((_n_slots) * (_max_line_size))
+#endif
+
+typedef struct emsh_iov
+{
+	const char *base;
+	size_t len;
+} emsh_iov_t;
+
+#if EMSH_ENABLE_COMPLETION
+/// the word being completed; ops.complete reports the candidates with emsh_complete_add()
+typedef struct emsh_completion
+{
+	int index; ///< of the word in the line, 0 for the command name
+	const emsh_iov_t *args; ///< the index words before it, not terminated
+	const char *word; ///< from its start up to the cursor, not terminated
+	size_t len;
+	bool list; ///< the candidates are listed rather than completed (second Tab in a row)
+
+	///@internal
+	struct emsh *sh;
+	size_t n; ///< candidates so far
+	size_t ext_len; ///< common to all of them after the word
+	bool whole; ///< ext is a whole candidate
+	char ext[EMSH_MAX_COMPLETION_SIZE+1]; ///< room for a trailing space
+} emsh_completion_t;
+#endif
+
 ///@internal
 typedef struct emsh_ops
 {
-	void (*write_char)(uintptr_t cookie, char ch);
+	void (*write_char)(uintptr_t cookie, char ch); ///< nullable and unused by the shell, which writes through write_strn; see EMSH_DEFINE_WRITE_STRN
 	void (*write_strn)(uintptr_t cookie, const char *str, size_t len);
-	void (*exec)(uintptr_t cookie, int argc, const char **argv);
+	void (*write_iov)(uintptr_t cookie, const struct emsh_iov *iov, size_t n); ///< nullable, one logical screen update
+	void (*exec)(uintptr_t cookie, int argc, const char **argv); ///< nullable if exec_spans isn't
+	void (*exec_spans)(uintptr_t cookie, int argc, const struct emsh_iov *args); ///< nullable, used instead of exec; the arguments are unquoted and terminated
+	void (*flush)(uintptr_t cookie); ///< nullable, called once per input event or batch
+	void (*hist_append)(uintptr_t cookie, const char *line, size_t len); ///< nullable, called with each entry a commit adds to the history (e.g. to persist it), not with a line the dedup policy leaves out
+#if EMSH_ENABLE_COMPLETION
+	void (*complete)(uintptr_t cookie, struct emsh_completion *c); ///< nullable, called on Tab
+#endif
+	void (*term_size)(uintptr_t cookie, size_t rows, size_t cols); ///< nullable, called with the answer to emsh_query_term_size()
+	uint32_t (*now_ms)(uintptr_t cookie); ///< nullable, a wrapping millisecond clock which enables the ESC timeout
 } emsh_ops_t;
 
+#if EMSH_ENABLE_STATS
+typedef struct emsh_stats
+{
+	size_t n_writes_saved; ///< write_strn calls coalesced by the output buffer
+	size_t n_redraw_bytes_saved; ///< bytes not sent thanks to diff-based redraws
+} emsh_stats_t;
+#endif
+
 ///@internal
 typedef struct emsh
 {
@@ -84,13 +294,78 @@ typedef struct emsh
 	bool running;
 	emsh_hist_t hist;
 	emsh_buf_t buf;
+#if EMSH_ENABLE_RUNTIME_SIZE
+	char *line; ///< max_line_size + 1 bytes
+	char *draft; ///< the line saved while browsing the history
+#else
+	char line[EMSH_MAX_LINE_SIZE+1];
+	char draft[EMSH_MAX_LINE_SIZE+1];
+#endif
+#if EMSH_ENABLE_PREFIX_SEARCH
+	size_t prefix_len; ///< of the draft, which filters the history navigation
+#endif
+#if EMSH_ENABLE_COMPLETION
+	bool tab_pending; ///< the last key was a Tab which couldn't complete
+#endif
+#if EMSH_ENABLE_SHARED_HIST
+	struct
+	{
+		emsh_shared_hist_t *hist; ///< null when Up/Down browse the own history
+		size_t base; ///< tail of the shared history when browsing started
+		size_t pos; ///< age from base of the entry being edited (0 is the draft)
+		size_t len;
+#if EMSH_ENABLE_RUNTIME_SIZE
+		char *line; ///< the recalled entry
+#else
+		char line[EMSH_MAX_LINE_SIZE+1];
+#endif
+	} shared;
+#endif
+
+	struct
+	{
+#if EMSH_ENABLE_OUTPUT_BUFFER
+		bytearray_t buf;
+#endif
+		bool dirty; ///< written since the last flush
+	} out;
+
+#if EMSH_ENABLE_STATS
+	emsh_stats_t stats;
+#endif
+
+#if EMSH_ENABLE_SEARCH
+	struct
+	{
+		bool active;
+		bool failed;
+		size_t age; ///< of the match, 0 for none
+		size_t len;
+		char query[EMSH_MAX_SEARCH_SIZE];
+	} search;
+#endif
+
+#if EMSH_ENABLE_BRACKETED_PASTE
+	struct
+	{
+		bool active;
+		bool at_prompt; ///< no pasted line has been echoed yet
+		unsigned char matched; ///< bytes of the end marker received so far
+		bool dropping; ///< a pasted line stopped the shell, the rest of the paste is dropped
+	} paste;
+#endif
 
 	struct
 	{
 		ctlseq_st_t st;
-		char param_byte;
+		char priv_byte; ///< the first parameter byte if it marks a private parameter string, else 0x00
 		char interm_byte;
+		unsigned char n_params; ///< parameter sub-strings ended so far, EMSH_MAX_CSI_PARAMS + 1 if they can't be decoded
+		uint16_t params[EMSH_MAX_CSI_PARAMS]; ///< 0 when empty, saturated at UINT16_MAX
 	} ctlseq;
+	bool term_size_pending; ///< a cursor position report answers emsh_query_term_size()
+	uint32_t esc_time; ///< of the ESC which may start a control sequence, by ops.now_ms
+	uint32_t esc_timeout_ms;
 
 	struct
 	{
@@ -98,22 +373,79 @@ typedef struct emsh
 		size_t optpos;
 #endif
 		int argc;
-		const char *argv[EMSH_MAX_N_ARGS];
+#if EMSH_ENABLE_RUNTIME_SIZE
+		emsh_iov_t *args;
+		const char **argv;
+		int max_n_args;
+#else
+		emsh_iov_t args[EMSH_MAX_N_ARGS];
+		const char *argv[EMSH_MAX_N_ARGS]; ///< of args, built by emsh_argv()
+#endif
 	} cmd;
+
+#if EMSH_ENABLE_RUNTIME_SIZE
+	size_t max_line_size;
+#endif
 } emsh_t;
 
 typedef struct emsh_conf
 {
 	uintptr_t cookie; ///< arbitrary data for ops
 	emsh_ops_t ops;
-	emsh_block_t *blocks; ///< EMSH_MAX_HIST_SIZE elements
+#if EMSH_ENABLE_RUNTIME_SIZE
+	char *hist_mem;
+	size_t hist_mem_size; ///< at least EMSH_HIST_ENTRY_SIZE(max_line_size) bytes
+	emsh_hist_slot_t *hist_ring; ///< max_hist_size elements
+#if EMSH_ENABLE_PREFIX_SEARCH
+	size_t *hist_sorted; ///< max_hist_size elements
+#endif
+#if EMSH_HIST_DEDUP == EMSH_HIST_DEDUP_MOVE
+	size_t *hist_hash; ///< EMSH_HIST_HASH_SIZE(max_hist_size) elements
+#endif
+#if EMSH_ENABLE_SEARCH_INDEX
+	emsh_hist_trigram_t *hist_trigrams; ///< EMSH_SEARCH_INDEX_SIZE elements
+	size_t *hist_chain; ///< hist_mem_size elements
+#endif
+	size_t max_hist_size;
+	char *line_mem; ///< EMSH_LINE_MEM_SIZE(max_line_size) bytes
+	size_t max_line_size; ///< doesn't include terminator
+	emsh_iov_t *args; ///< max_n_args elements
+	const char **argv; ///< max_n_args elements
+	int max_n_args;
+#else
+	char *hist_mem; ///< EMSH_HIST_MEM_SIZE bytes
+#endif
+#if EMSH_ENABLE_SHARED_HIST
+	emsh_shared_hist_t *shared_hist; ///< nullable, may be used by several sessions at once
+#endif
+#if EMSH_ENABLE_OUTPUT_BUFFER
+	char *out_buf; ///< nullable, collects the output of one emsh_task() call
+	size_t out_buf_size;
+#endif
+	uint32_t esc_timeout_ms; ///< 0 for EMSH_ESC_TIMEOUT_MS
 } emsh_conf_t;
 
+#if EMSH_ENABLE_RUNTIME_SIZE
+#define EMSH_LINE_MEM_SIZE(_max_line_size) ((2 + EMSH_ENABLE_SHARED_HIST) * ((_max_line_size) + 1))
+#endif
+
 void emsh_init(emsh_t *self, const emsh_conf_t *conf);
 void emsh_start(emsh_t *self);
 void emsh_task(emsh_t *self, int c);
-void emsh_stop(emsh_t *self);
+size_t emsh_task_n(emsh_t *self, const char *buf, size_t len); ///< returns the number of consumed bytes (stops early when the shell gets stopped)
+void emsh_stop(emsh_t *self); ///< from a command, or before leaving the terminal; the input after the command is left to the next emsh_start()
+int32_t emsh_poll(emsh_t *self); ///< applies the timeouts due; returns the milliseconds until it has to be called again, -1 if nothing is pending
+void emsh_query_term_size(emsh_t *self); ///< asks the terminal for its size in one round trip; ops.term_size gets the answer
+#if EMSH_ENABLE_SHARED_HIST
+void emsh_shared_hist_init(emsh_shared_hist_t *self, emsh_shared_hist_slot_t *slots, atomic_uchar *mem, size_t n_slots, size_t max_line_size); ///< before any session uses it
+#endif
+#if EMSH_ENABLE_COMPLETION
+void emsh_complete_add(emsh_completion_t *c, const char *str, size_t len, size_t n); ///< from ops.complete, n candidates starting with str (n is 1 when str is a candidate)
+#endif
+const char **emsh_argv(emsh_t *self); ///< from ops.exec_spans, the arguments as an argv array (argc elements)
+bool emsh_hist_push(emsh_t *self, const char *line, size_t len); ///< adds a history entry without running it (e.g. to restore a saved history before emsh_start()); false if it's too long
 
+/// defines a write_strn for ops from a function writing one character
 #define EMSH_DEFINE_WRITE_STRN(_name, _write_char)            \
 	void _name(uintptr_t cookie, const char *str, size_t len) \
 	{                                                         \
@@ -129,6 +461,14 @@ bool emsh_running(const emsh_t *self)
 	return self->running;
 }
 
+#if EMSH_ENABLE_STATS
+static inline
+const emsh_stats_t *emsh_stats(const emsh_t *self)
+{
+	return &self->stats;
+}
+#endif
+
 #if EMSH_ENABLE_GETOPT
 int emsh_getopt(emsh_t *self, int argc, const char **argv, const char *optstring);
 extern const char *emsh_optarg;
@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: BSL-1.0
+
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(GAPBUF_H_INCLUDED)
+#define GAPBUF_H_INCLUDED
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef unsigned char gapbuf_datum_t;
+
+/*
+ * |<--                   capacity                   -->|
+ * |<--  front  -->|<--     gap     -->|<--   back   -->|
+ * |xxxxxxxxxxxxxxx|*******************|xxxxxxxxxxxxxxxx|
+ *  ^               ^                   ^
+ *  data          gap_begin           gap_end
+ *
+ *  x := valid element
+ *  * := invalid element
+ *
+ * Inserting and erasing at the gap are O(1); the gap is moved to the position
+ * of an edit first, which costs O(distance) only when the position changes.
+ */
+typedef struct gapbuf
+{
+	size_t capacity;
+	size_t gap_begin;
+	size_t gap_end;
+	gapbuf_datum_t *data;
+} gapbuf_t;
+
+static inline
+void gapbuf_init(gapbuf_t *self, size_t n, gapbuf_datum_t *p)
+{
+	assert(n != 0);
+	assert(p != NULL);
+
+	self->capacity = n;
+	self->gap_begin = 0;
+	self->gap_end = n;
+	self->data = p;
+}
+
+static inline
+void gapbuf_destroy(gapbuf_t *self)
+{
+	self->capacity = 0;
+	self->gap_begin = 0;
+	self->gap_end = 0;
+	self->data = NULL;
+}
+
+static inline
+size_t gapbuf_capacity(const gapbuf_t *self)
+{
+	return self->capacity;
+}
+
+static inline
+size_t gapbuf_room(const gapbuf_t *self)
+{
+	return self->gap_end - self->gap_begin;
+}
+
+static inline
+size_t gapbuf_size(const gapbuf_t *self)
+{
+	return gapbuf_capacity(self) - gapbuf_room(self);
+}
+
+static inline
+bool gapbuf_empty(const gapbuf_t *self)
+{
+	return gapbuf_size(self) == 0;
+}
+
+static inline
+size_t gapbuf_gap_pos(const gapbuf_t *self)
+{
+	return self->gap_begin;
+}
+
+/// elements before the gap
+static inline
+const gapbuf_datum_t *gapbuf_front(const gapbuf_t *self, size_t *p_n)
+{
+	*p_n = self->gap_begin;
+	return self->data;
+}
+
+/// elements after the gap
+static inline
+const gapbuf_datum_t *gapbuf_back(const gapbuf_t *self, size_t *p_n)
+{
+	*p_n = self->capacity - self->gap_end;
+	return &self->data[self->gap_end];
+}
+
+static inline
+gapbuf_datum_t gapbuf_at(const gapbuf_t *self, size_t pos)
+{
+	assert(pos < gapbuf_size(self));
+
+	return pos < self->gap_begin ? self->data[pos] : self->data[pos + gapbuf_room(self)];
+}
+
+static inline
+void gapbuf_clear(gapbuf_t *self)
+{
+	self->gap_begin = 0;
+	self->gap_end = self->capacity;
+}
+
+/// the elements have to be contiguous (see gapbuf_compact())
+static inline
+void gapbuf_resize(gapbuf_t *self, size_t n)
+{
+	assert(n <= gapbuf_capacity(self));
+	assert(self->gap_end == self->capacity);
+
+	self->gap_begin = n;
+}
+
+static inline
+void gapbuf_move_gap(gapbuf_t *self, size_t pos)
+{
+	assert(pos <= gapbuf_size(self));
+
+	if (pos < self->gap_begin)
+	{
+		size_t n = self->gap_begin - pos;
+		memmove(&self->data[self->gap_end - n], &self->data[pos], n);
+		self->gap_begin -= n;
+		self->gap_end -= n;
+	}
+	else if (pos > self->gap_begin)
+	{
+		size_t n = pos - self->gap_begin;
+		memmove(&self->data[self->gap_begin], &self->data[self->gap_end], n);
+		self->gap_begin += n;
+		self->gap_end += n;
+	}
+}
+
+/// moves the gap to the end, so that the elements are contiguous from data
+static inline
+gapbuf_datum_t *gapbuf_compact(gapbuf_t *self)
+{
+	gapbuf_move_gap(self, gapbuf_size(self));
+
+	return self->data;
+}
+
+static inline
+void gapbuf_insert(gapbuf_t *self, size_t pos, gapbuf_datum_t val)
+{
+	assert(gapbuf_room(self) > 0);
+
+	gapbuf_move_gap(self, pos);
+	self->data[self->gap_begin] = val;
+	++self->gap_begin;
+}
+
+static inline
+void gapbuf_insert_n(gapbuf_t *self, size_t pos, const gapbuf_datum_t *data, size_t n)
+{
+	assert(gapbuf_room(self) >= n);
+
+	gapbuf_move_gap(self, pos);
+	memcpy(&self->data[self->gap_begin], data, n);
+	self->gap_begin += n;
+}
+
+static inline
+void gapbuf_erase(gapbuf_t *self, size_t pos)
+{
+	assert(pos < gapbuf_size(self));
+
+	gapbuf_move_gap(self, pos);
+	++self->gap_end;
+}
+
+static inline
+void gapbuf_erase_n(gapbuf_t *self, size_t pos, size_t n)
+{
+	assert(gapbuf_size(self) >= n);
+	assert(pos <= gapbuf_size(self) - n);
+
+	gapbuf_move_gap(self, pos);
+	self->gap_end += n;
+}
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // GAPBUF_H_INCLUDED
@@ -5,7 +5,50 @@
 //          https://www.boost.org/LICENSE_1_0.txt)
 
 #include "numcast10.h"
+#include <string.h>
 
+// "00" "01" ... "99"
+static const char numcast10_impl_digit_pairs[200] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const unsigned long long numcast10_impl_pow10[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL,
+	100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL,
+	10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+	1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+/// number of decimal digits of src != 0
+static inline
+size_t numcast10_impl_n_digits(unsigned long long src)
+{
+#if defined(__GNUC__) && ULLONG_MAX == 0xFFFFFFFFFFFFFFFFULL
+	// floor(log10(2^bits)) with log10(2) ~ 1233 / 4096, then one less if src is below that power
+	size_t bits = CHAR_BIT * sizeof(src) - (size_t)__builtin_clzll(src);
+	size_t n = (bits * 1233) >> 12;
+	return n + 1 - (src < numcast10_impl_pow10[n]);
+#else
+	size_t n = 1;
+	while (n < sizeof(numcast10_impl_pow10) / sizeof(numcast10_impl_pow10[0]) && src >= numcast10_impl_pow10[n])
+	{
+		++n;
+	}
+	if (n == sizeof(numcast10_impl_pow10) / sizeof(numcast10_impl_pow10[0]))
+	{
+		for (src /= numcast10_impl_pow10[n - 1]; src >= 10; src /= 10)
+		{
+			++n;
+		}
+	}
+	return n;
+#endif
+}
+
+// the digits are counted first, then written two at a time from the end
 #define NUMCAST10_IMPL_DEFINE_BW_FUNC(name, T) \
 	NUMCAST10_IMPL_BW_FUNC_PROTOTYPE(name, T) \
 	{ \
@@ -17,20 +60,36 @@
 \
 		if (src != 0) \
 		{ \
-			size_t n = 0; \
-\
-			while (src != 0) \
+			size_t n; \
+			if (sizeof(T) <= sizeof(unsigned long long)) \
 			{ \
-				dst[n] = (src % 10) + '0'; \
-				src /= 10; \
-				++n; \
+				n = numcast10_impl_n_digits((unsigned long long)src); \
+			} \
+			else \
+			{ \
+				n = 1; \
+				for (T t = src; t >= 10; t /= 10) \
+				{ \
+					++n; \
+				} \
 			} \
 \
-			for (size_t i = 0; i < n / 2; ++i) \
+			char *p = dst + n; \
+			while (src >= 100) \
+			{ \
+				T q = src / 100; \
+				size_t r = (size_t)(src - q * 100); \
+				src = q; \
+				p -= 2; \
+				memcpy(p, &numcast10_impl_digit_pairs[2 * r], 2); \
+			} \
+			if (src >= 10) \
+			{ \
+				memcpy(p - 2, &numcast10_impl_digit_pairs[2 * (size_t)src], 2); \
+			} \
+			else \
 			{ \
-				char ch = dst[i]; \
-				dst[i] = dst[n-i-1]; \
-				dst[n-i-1] = ch; \
+				p[-1] = (char)('0' + src); \
 			} \
 \
 			return n; \